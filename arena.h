@@ -0,0 +1,150 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Scene lifetime bump allocator. Geometry, acceleration structures and materials are carved out
+// of large 64 byte aligned blocks and released all at once when the arena is destroyed:
+// destructors run in reverse order of creation, then the blocks are freed. Every allocation
+// starts on a cache line. Not thread safe, scenes are built on one thread.
+//
+// Objects made with make_shared() are still destroyed when their last owner goes away, but
+// their memory only comes back with the arena, which has to outlive them. Declaring the arena
+// first in a scene (or a class) gets that order right.
+
+class arena {
+public:
+  static constexpr size_t alignment = 64;
+
+  explicit arena(size_t _block_size = 1 << 20) : block_size{round_up(std::max<size_t>(_block_size, alignment))} {}
+
+  arena(const arena&) = delete;
+  arena& operator=(const arena&) = delete;
+
+  ~arena() {
+    for (auto d = destructors.rbegin(); d != destructors.rend(); d++)
+      d->destroy(d->objects, d->count);
+    for (auto block : blocks) free_block(block);
+  }
+
+  void* allocate(size_t bytes) {
+    // Allocations larger than a quarter block get a block of their own, so they do not waste
+    // the rest of the current one.
+    bytes = round_up(std::max<size_t>(bytes, 1));
+    allocated += bytes;
+    if (bytes > block_size / 4)
+      return new_block(bytes);
+    if (current == nullptr || used + bytes > block_size) {
+      current = static_cast<unsigned char*>(new_block(block_size));
+      used = 0;
+    }
+    void* p = current + used;
+    used += bytes;
+    return p;
+  }
+
+  template<typename T>
+  T* allocate_array(size_t n) {
+    // Uninitialized storage for `n` objects the caller fills in (nodes, indices, ...).
+    static_assert(std::is_trivially_destructible_v<T>, "use create_array for types with a destructor");
+    static_assert(alignof(T) <= alignment);
+    return static_cast<T*>(allocate(sizeof(T) * n));
+  }
+
+  template<typename T, typename... Args>
+  T* create(Args&&... args) {
+    static_assert(alignof(T) <= alignment);
+    T* object = new (allocate(sizeof(T))) T(std::forward<Args>(args)...);
+    if constexpr (!std::is_trivially_destructible_v<T>)
+      destructors.push_back({object, 1, destroy<T>});
+    return object;
+  }
+
+  template<typename T>
+  T* create_array(size_t n) {
+    // `n` default constructed objects, destroyed with the arena.
+    static_assert(alignof(T) <= alignment);
+    T* objects = static_cast<T*>(allocate(sizeof(T) * n));
+    for (size_t i = 0; i < n; i++) new (objects + i) T();
+    if constexpr (!std::is_trivially_destructible_v<T>)
+      destructors.push_back({objects, n, destroy<T>});
+    return objects;
+  }
+
+  template<typename T>
+  struct allocator {
+    // Standard allocator drawing from an arena, deallocation is a no-op.
+    using value_type = T;
+    arena* owner;
+
+    allocator(arena* _owner) : owner{_owner} {}
+    template<typename U> allocator(const allocator<U>& other) : owner{other.owner} {}
+
+    T* allocate(size_t n) { return static_cast<T*>(owner->allocate(sizeof(T) * n)); }
+    void deallocate(T*, size_t) {}
+
+    template<typename U> bool operator==(const allocator<U>& other) const { return owner == other.owner; }
+    template<typename U> bool operator!=(const allocator<U>& other) const { return owner != other.owner; }
+  };
+
+  template<typename T, typename... Args>
+  std::shared_ptr<T> make_shared(Args&&... args) {
+    // Like std::make_shared, with the object and its control block in the arena.
+    return std::allocate_shared<T>(allocator<T>{this}, std::forward<Args>(args)...);
+  }
+
+  size_t bytes_allocated() const { return allocated; }
+  size_t bytes_reserved() const { return reserved; }
+
+private:
+  struct destructor {
+    void* objects;
+    size_t count;
+    void (*destroy)(void*, size_t);
+  };
+
+  size_t block_size;
+  std::vector<void*> blocks;
+  std::vector<destructor> destructors;
+  unsigned char* current = nullptr;
+  size_t used = 0;
+  size_t allocated = 0;
+  size_t reserved = 0;
+
+  static size_t round_up(size_t bytes) { return (bytes + alignment - 1) & ~(alignment - 1); }
+
+  template<typename T>
+  static void destroy(void* objects, size_t count) {
+    for (size_t i = count; i > 0; i--)
+      static_cast<T*>(objects)[i - 1].~T();
+  }
+
+  void* new_block(size_t bytes) {
+#if _MSC_VER >= 1900
+    void* block = _aligned_malloc(bytes, alignment);
+#else
+    void* block = std::aligned_alloc(alignment, bytes);
+#endif
+    if (block == nullptr) throw std::bad_alloc();
+    blocks.push_back(block);
+    reserved += bytes;
+    return block;
+  }
+
+  static void free_block(void* block) {
+#if _MSC_VER >= 1900
+    _aligned_free(block);
+#else
+    free(block);
+#endif
+  }
+};
+
+#endif
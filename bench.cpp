@@ -0,0 +1,129 @@
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "color.h"
+#include "scene.h"
+#include "stats.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// Renders the standard scenes at a fixed size, sample count and seed, and prints the results as
+// JSON on standard output (logs go to standard error), so they can be compared across versions.
+// usage: tiny-ray-tracer-bench [--width N] [--spp N] [--depth N] [--scenes DIR] [--images DIR]
+//                              [--cache] [scene...]
+//
+// Models are loaded without the mesh cache unless --cache is given, so that load_ms includes
+// building their BVHs. Images are thrown away unless --images names a directory to keep them
+// in. Peak RSS is the process's, so it only grows from one scene to the next; benchmark scenes
+// one at a time to get each one's own.
+//
+// Counting slows rendering down, so the timings come from tiny-ray-tracer-bench, built without
+// RTW_STATS, and the counters from tiny-ray-tracer-bench-stats, built with it. The latter times
+// its runs too, but reports them as instrumented_load_ms and so on, not to be taken for the real
+// ones. Both render the same rays, so the rays of one over the render_ms of the other give the
+// ray throughput.
+
+const char* default_scenes[] = {"final_scene", "four_spheres", "cow", "dragon", "robots", "eva_army"};
+
+double milliseconds_since(std::chrono::high_resolution_clock::time_point start) {
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+  return elapsed.count();
+}
+
+double peak_rss_mb() {
+#ifndef _WIN32
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / (1024.0 * 1024.0);  // bytes
+#else
+  return usage.ru_maxrss / 1024.0;  // kilobytes
+#endif
+#else
+  return 0;
+#endif
+}
+
+int main(int argc, char** argv) {
+  int width = 320, samples = 16, depth = 8;
+  std::string scene_dir = "scenes", image_dir;
+  bool use_cache = false;
+  std::vector<std::string> names;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--width" && has_value) width = atoi(argv[++i]);
+    else if (arg == "--spp" && has_value) samples = atoi(argv[++i]);
+    else if (arg == "--depth" && has_value) depth = atoi(argv[++i]);
+    else if (arg == "--scenes" && has_value) scene_dir = argv[++i];
+    else if (arg == "--images" && has_value) image_dir = argv[++i];
+    else if (arg == "--cache") use_cache = true;
+    else names.push_back(arg);
+  }
+  if (names.empty()) names.assign(std::begin(default_scenes), std::end(default_scenes));
+#ifndef _WIN32
+  if (!use_cache) setenv("RTW_MESH_CACHE", "0", 1);
+#endif
+
+#ifdef RTW_STATS
+  bool instrumented = true;
+  const char* timing = "instrumented_";
+#else
+  bool instrumented = false;
+  const char* timing = "";
+#endif
+
+  printf("{\n  \"settings\": {\"width\": %d, \"samples_per_pixel\": %d, \"max_depth\": %d, "
+         "\"threads\": %u, \"mesh_cache\": %s, \"instrumented\": %s},\n  \"scenes\": [",
+         width, samples, depth, std::thread::hardware_concurrency(), use_cache ? "true" : "false",
+         instrumented ? "true" : "false");
+
+  for (size_t n = 0; n < names.size(); n++) {
+    const auto& name = names[n];
+    std::clog << "Benchmarking " << name << std::endl;
+    stats::reset();
+
+    // Same random fields in every run, whatever ran before
+    seed_random(1);
+    scene s;
+    auto start = std::chrono::high_resolution_clock::now();
+    if (!s.load(scene_dir + "/" + name + ".scene")) return 1;
+    double load_ms = milliseconds_since(start);
+
+    start = std::chrono::high_resolution_clock::now();
+    s.build();
+    double build_ms = milliseconds_since(start);
+
+    s.cam.image_width = width;
+    s.cam.samples_per_pixel = samples;
+    s.cam.max_depth = depth;
+    s.cam.seed = 0;
+    s.frames.clear();
+#ifdef _WIN32
+    s.out_path = image_dir.empty() ? "NUL" : image_dir + "/" + name + ".png";
+#else
+    s.out_path = image_dir.empty() ? "/dev/null" : image_dir + "/" + name + ".png";
+#endif
+
+    start = std::chrono::high_resolution_clock::now();
+    s.render();
+    double render_ms = milliseconds_since(start);
+
+    printf("%s\n    {\"name\": \"%s\", \"%sload_ms\": %.3f, \"%sbuild_ms\": %.3f, \"%srender_ms\": %.3f, "
+           "\"peak_rss_mb\": %.1f", n == 0 ? "" : ",", name.c_str(), timing, load_ms, timing, build_ms,
+           timing, render_ms, peak_rss_mb());
+    if (instrumented) printf(", \"stats\": %s", stats::collect().json().c_str());
+    printf("}");
+    fflush(stdout);
+  }
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -5,15 +5,65 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "arena.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <stdlib.h>
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <ostream>
 
 #define BINS 128
 
 struct bin { aabb bounds; int primitives_count = 0; };
 
+// Build options of a bvh
+enum bvh_flags : unsigned {
+  BVH_REORDER_PRIMITIVES = 1 << 0,  // permute the primitives into leaf order, so leaves read them directly
+  BVH_COMPRESS = 1 << 1,            // keep the tree as bvh_compressed_node, without full nodes
+};
+
+struct bvh_compressed_node // in total 24 bytes, against 64 for the pair of bvh_node it replaces
+{
+  // The two children of an interior node. Their bounds are stored in 255ths of the node's own
+  // box (decoded from its parent's, down from the root), rounded outwards: lo counts up from the
+  // box's minimum and hi down from its maximum, so 0 and 255 give the box's own faces exactly.
+  uint8_t lo[2][3], hi[2][3]; // 12
+  int child[2];               // 8, the compressed node of an interior child, -1 - first primitive of a leaf
+  uint16_t count[2];          // 4, primitives of a leaf child, 0 for an interior one
+
+  static aabb decode(const aabb& box, const uint8_t* lo, const uint8_t* hi) {
+    vec3f step = (1.0f / 255) * (box.bmax - box.bmin);
+    aabb child;
+    child.bmin = box.bmin + vec3f(lo[0], lo[1], lo[2]) * step;
+    child.bmax = box.bmax - vec3f(255 - hi[0], 255 - hi[1], 255 - hi[2]) * step;
+    return child;
+  }
+
+  static void encode(const aabb& box, const aabb& child, uint8_t* lo, uint8_t* hi) {
+    vec3f extent = box.bmax - box.bmin;
+    for (int a = 0; a < 3; a++) {
+      float l = extent[a] > 0 ? std::floor((child.bmin[a] - box.bmin[a]) / extent[a] * 255) : 0;
+      float h = extent[a] > 0 ? std::ceil((child.bmax[a] - box.bmin[a]) / extent[a] * 255) : 255;
+      lo[a] = uint8_t(std::clamp(l, 0.0f, 255.0f));
+      hi[a] = uint8_t(std::clamp(h, 0.0f, 255.0f));
+    }
+    // Rounding can still leave a face a hair inside the child, widen until the decoded box holds it
+    for (bool inside = false; !inside;) {
+      aabb decoded = decode(box, lo, hi);
+      inside = true;
+      for (int a = 0; a < 3; a++) {
+        if (decoded.bmin[a] > child.bmin[a] && lo[a] > 0) lo[a]--, inside = false;
+        if (decoded.bmax[a] < child.bmax[a] && hi[a] < 255) hi[a]++, inside = false;
+      }
+    }
+  }
+};
+
 struct bvh_node // in total 32 bytes
 {
   aabb bbox; // 24
@@ -27,58 +77,114 @@ struct bvh_node // in total 32 bytes
 	}
 };
 
+struct bvh_quality {
+  // Measures of a built tree, to compare builders and catch bad builds. Filled in by
+  // bvh::quality() and tlas::quality() a node at a time.
+  static constexpr int max_leaf_size = 16;  // leaves larger than this share the last histogram bucket
+  static constexpr double node_cost = 1;    // SAH cost of a box test, relative to ...
+  static constexpr double primitive_cost = 1;  // ... the cost of a primitive test
+
+  double sah_cost = 0;       // expected cost of a ray hitting the root, in primitive tests
+  int nodes = 0;             // interior nodes and leaves
+  int leaves = 0;
+  int max_depth = 0;         // the root is at depth 0
+  double average_depth = 0;  // of the leaves
+  int leaf_sizes[max_leaf_size + 1] = {};  // number of leaves by primitive count
+  size_t memory = 0;         // bytes of nodes and primitive indices
+  double overlap = 0;        // mean over interior nodes of the area shared by the children, relative to theirs
+
+  void add_leaf(const aabb& box, int depth, int primitives) {
+    nodes++, leaves++;
+    max_depth = std::max(max_depth, depth);
+    average_depth += depth;
+    leaf_sizes[std::min(primitives, max_leaf_size)]++;
+    sah_cost += primitive_cost * area(box) * primitives;
+  }
+
+  void add_interior(const aabb& box, int depth, const aabb& left, const aabb& right) {
+    nodes++;
+    max_depth = std::max(max_depth, depth);
+    sah_cost += node_cost * area(box);
+    aabb shared(fmaxf(left.bmin, right.bmin), fminf(left.bmax, right.bmax));
+    bool disjoint = shared.bmin.x() > shared.bmax.x() || shared.bmin.y() > shared.bmax.y() || shared.bmin.z() > shared.bmax.z();
+    auto both = area(aabb(left, right));
+    if (!disjoint && both > 0) overlap += area(shared) / both;
+  }
+
+  void finish(const aabb& root) {
+    // Turns the sums into averages, with areas relative to the root's.
+    auto root_area = area(root);
+    sah_cost = root_area > 0 ? sah_cost / root_area : 0;
+    average_depth = leaves > 0 ? average_depth / leaves : 0;
+    overlap = nodes > leaves ? overlap / (nodes - leaves) : 0;
+  }
+
+  void print(std::ostream& out, const char* name) const {
+    char line[160];
+    snprintf(line, sizeof(line), "%s quality: SAH cost %.2f, %d nodes, %d leaves, depth %d max %.1f average, "
+             "overlap %.3f, %.1f KB\n", name, sah_cost, nodes, leaves, max_depth, average_depth, overlap, memory / 1024.0);
+    out << line << "  leaf sizes:";
+    for (int n = 0; n <= max_leaf_size; n++) {
+      if (leaf_sizes[n] == 0) continue;
+      snprintf(line, sizeof(line), " %d%s:%d", n, n == max_leaf_size ? "+" : "", leaf_sizes[n]);
+      out << line;
+    }
+    out << std::endl;
+  }
+
+private:
+  static double area(const aabb& box) {
+    vec3f e = box.bmax - box.bmin;
+    return e.x() * e.y() + e.y() * e.z() + e.z() * e.x();
+  }
+};
+
 template<typename T>
 class bvh : public hittable
 {
 public:
   bvh() = default;
-  bvh(T* _primtives, int N) {
+  bvh(T* _primtives, int N, arena* mem = nullptr, unsigned _flags = 0) {
+    // Nodes and indices come from `mem`, or from an arena of the BVH's own if none is given.
+    // With BVH_REORDER_PRIMITIVES the array at `_primtives` is permuted into leaf order; the
+    // primitives have to be copyable, and their order means nothing to the caller any more.
+    // With BVH_COMPRESS only the compressed nodes are kept, see compress().
     primitives_count = N;
     primitives = _primtives;
-#if _MSC_VER >= 1900
-    bvh_nodes = (bvh_node*)_aligned_malloc(sizeof(bvh_node) * N * 2, 64);
-#else
-    bvh_nodes = (bvh_node*) std::aligned_alloc(64, sizeof(bvh_node) * N * 2);
-#endif
-    primitives_idx = new int[N];
+    flags = _flags;
+    allocate(mem);
     build();
   }
 
-  bvh(bvh&& a)
-    : inv_transform{a.inv_transform},
-      bounds{a.bounds},
-      bvh_nodes{a.bvh_nodes},
-      primitives{a.primitives},
-      primitives_idx(a.primitives_idx),
-      nodes_used{a.nodes_used}, primitives_count{a.primitives_count},
-      center{a.center} {
-        bvh_nodes = nullptr;
-        primitives_idx = nullptr;
-        primitives = nullptr;
-        nodes_used = 0;
-        primitives_count = 0;
-  }
-  
-  bvh<T>& operator=(bvh&& a) {
-    std::swap(bvh_nodes, a.bvh_nodes);
-    std::swap(primitives_idx, a.primitives_idx);
-    std::swap(primitives, a.primitives);
-    return *this;
-  }
- 
-  ~bvh() {
-    if (bvh_nodes != nullptr) {
-      free(bvh_nodes);
-      bvh_nodes = nullptr;
-    }
-    delete[] primitives_idx;
-    primitives_idx = nullptr;
-    nodes_used = 0;
+  bvh(T* _primtives, int N, const bvh_node* nodes, int node_count, const int* indices, arena* mem = nullptr,
+      unsigned _flags = 0) {
+    // Adopts a BVH built earlier over the same primitives, e.g. one read back from a mesh cache.
+    // The nodes are taken in the treelet layout build() leaves them in, so they are not laid out
+    // again. Of the flags only BVH_COMPRESS applies, the primitives are taken in the order given.
+    primitives_count = N;
+    primitives = _primtives;
+    flags = _flags;
+    allocate(mem);
+    nodes_used = node_count;
+    std::copy(nodes, nodes + node_count, bvh_nodes);
+    std::copy(indices, indices + N, primitives_idx);
+    // A tree built with BVH_REORDER_PRIMITIVES (and primitives saved in that order) needs no indices
+    direct = true;
+    for (int i = 0; i < N && direct; i++) direct = primitives_idx[i] == i;
+
+    bounds = aabb(bvh_nodes[0].bbox.bmin, bvh_nodes[0].bbox.bmax);
+    center = (bounds.bmax + bounds.bmin) / 2.0f;
+    if (flags & BVH_COMPRESS) compress();
   }
+
+  bvh(bvh&&) = default;
+  bvh<T>& operator=(bvh&&) = default;
  
   void build() {
+    RTW_SPAN("bvh build", primitives_count);
     // reset node pool
     nodes_used = 2;
+    direct = false;
     // populate triangle index array
     for (int i = 0; i < primitives_count; i++)
       primitives_idx[i] = i;
@@ -91,19 +197,34 @@ public:
     using std::chrono::duration;
     using std::chrono::milliseconds;
     auto t1 = high_resolution_clock::now(); // measure render time
+    // bounds and centroids are looked up over and over while splitting, fetch them once
+    boxes.resize(primitives_count);
+    centroids.resize(primitives_count);
+    for (int i = 0; i < primitives_count; i++) {
+      boxes[i] = primitives[i].bounding_box();
+      centroids[i] = primitives[i].centroid();
+    }
     update_node_bounds(0);
     // subdivide recursively
     subdivide(0);
+    boxes = std::vector<aabb>();
+    centroids = std::vector<point3f>();
+    reorder();
+    if (flags & BVH_REORDER_PRIMITIVES) reorder_primitives();
     auto t2 = high_resolution_clock::now();
     /* Getting number of milliseconds as a double. */
     duration<double, std::milli> ms_double = t2 - t1;
     std::clog << "BVH construction time: " << ms_double.count() << "ms" << std::endl;
+    RTW_STAT(stats::local().bvh_build_ms += ms_double.count());
 
     bounds = aabb(bvh_nodes[0].bbox.bmin, bvh_nodes[0].bbox.bmax);
     center = (bounds.bmax + bounds.bmin) / 2.0f;
+    if (flags & BVH_COMPRESS) compress();
+    RTW_STAT(quality().print(std::clog, compressed_nodes ? "Compressed BVH" : "BVH"));
   }
   
   void refit() {
+    if (bvh_nodes == nullptr) return; // compressed, there are no full nodes left to refit
     for (int i = nodes_used - 1; i >= 0; i--) if (i != 1)
     {
       bvh_node& node = bvh_nodes[i];
@@ -124,19 +245,23 @@ public:
 
   bool hit(const ray& r, interval ray_t, hit_record& rec) const override
   {
+    if (compressed_nodes) return hit_compressed(r, ray_t, rec);
     const bvh_node *node = &bvh_nodes[0], *stack[64];
     int stack_ptr = 0;
     auto closest_so_far = ray_t.max;
     bool hit_anything = false;
+    RTW_STAT(auto& counters = stats::local());
  
     while (true)
     {
+      RTW_STAT(counters.bvh_nodes_visited++);
       if (node->is_leaf())
       {
         hit_record temp_rec;
+        RTW_STAT(counters.primitive_tests += node->primitives_count);
  
-        for (size_t i = 0; i < node->primitives_count; i++) {
-          T& primitive = primitives[primitives_idx[node->left_first + i]];
+        for (int first = node->left_first, i = 0; i < node->primitives_count; i++) {
+          T& primitive = direct ? primitives[first + i] : primitives[primitives_idx[first + i]];
           if (primitive.hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
             hit_anything = true;
             closest_so_far = temp_rec.t;
@@ -154,6 +279,7 @@ public:
         const bvh_node* child2 = &bvh_nodes[node->left_first + 1];
         interval i_b = interval(ray_t.min, closest_so_far);
         double dist2 = child2->bbox.hit(r, i_b);
+        RTW_STAT(counters.box_tests += 2);
         if (dist1 > dist2) { std::swap( dist1, dist2 ); std::swap( child1, child2 ); }
         if (dist1 == infinity)
         {
@@ -176,17 +302,266 @@ public:
   aabb bounding_box() const override { return bounds; }
     
   point3f centroid() const override { return center; }
+
+  void reorder_primitives() {
+    // Permutes the primitives so that every leaf covers a run of them, then indices are not
+    // needed (they are kept, as the identity, for refit() and the mesh cache).
+    std::vector<T> leaf_order(primitives_count);
+    for (int i = 0; i < primitives_count; i++) leaf_order[i] = primitives[primitives_idx[i]];
+    std::copy(leaf_order.begin(), leaf_order.end(), primitives);
+    for (int i = 0; i < primitives_count; i++) primitives_idx[i] = i;
+    direct = true;
+  }
+
+  void reorder() {
+    // Lays the nodes out again in treelets: the pairs below a node, breadth first, up to
+    // treelet_pairs of them (4 KB), then the treelets hanging off that one, depth first. A
+    // traversal then takes several steps within a treelet before jumping to another one. Sibling
+    // pairs keep a 64 byte line of their own (slot 1 stays unused), and leaves keep their
+    // ranges of primitives_idx.
+    constexpr int treelet_pairs = 4096 / (2 * sizeof(bvh_node));
+    if (nodes_used <= 2) return;
+    std::vector<bvh_node> old(bvh_nodes, bvh_nodes + nodes_used);
+    int next = 2;
+    std::vector<int> roots{0};  // placed nodes whose children start a treelet
+    std::vector<int> treelet, pending;
+    while (!roots.empty()) {
+      treelet.assign(1, roots.back());
+      roots.pop_back();
+      pending.clear();
+      int pairs = 0;
+      for (size_t k = 0; k < treelet.size(); k++) {
+        bvh_node& node = bvh_nodes[treelet[k]];
+        if (node.is_leaf()) continue;
+        if (pairs == treelet_pairs) {
+          pending.push_back(treelet[k]);
+          continue;
+        }
+        // node.left_first still holds the index of its children in the old layout
+        bvh_nodes[next] = old[node.left_first];
+        bvh_nodes[next + 1] = old[node.left_first + 1];
+        node.left_first = next;
+        treelet.push_back(next);
+        treelet.push_back(next + 1);
+        next += 2, pairs++;
+      }
+      roots.insert(roots.end(), pending.rbegin(), pending.rend());
+    }
+  }
+
+  bvh_quality quality() const {
+    // Walks the tree from the root, so it also works on trees read back from the mesh cache.
+    bvh_quality q;
+    if (primitives_count == 0) return q;
+    if (compressed_nodes) return compressed_quality();
+    std::vector<std::pair<int, int>> stack{{0, 0}};  // node, depth
+    while (!stack.empty()) {
+      auto [index, depth] = stack.back();
+      stack.pop_back();
+      const bvh_node& node = bvh_nodes[index];
+      if (node.is_leaf()) {
+        q.add_leaf(node.bbox, depth, node.primitives_count);
+        continue;
+      }
+      q.add_interior(node.bbox, depth, bvh_nodes[node.left_first].bbox, bvh_nodes[node.left_first + 1].bbox);
+      stack.push_back({node.left_first, depth + 1});
+      stack.push_back({node.left_first + 1, depth + 1});
+    }
+    q.memory = sizeof(bvh_node) * nodes_used + sizeof(int) * primitives_count;
+    q.finish(bvh_nodes[0].bbox);
+    return q;
+  }
+
+  void compress() {
+    // Replaces the nodes by bvh_compressed_node, top down so that every node is quantized
+    // against the box its parent decodes to. Trees whose root is a leaf, or with a leaf of more
+    // than 65535 primitives, are left as they are.
+    if (compressed_nodes || bvh_nodes == nullptr) return;
+    bool fits = nodes_used > 2;
+    for (int i = 2; i < nodes_used; i++)
+      fits = fits && bvh_nodes[i].primitives_count <= 0xffff;
+    if (!fits) {
+      if (!full_nodes.empty()) {
+        bvh_nodes = node_memory->allocate_array<bvh_node>(nodes_used);
+        std::copy(full_nodes.begin(), full_nodes.begin() + nodes_used, bvh_nodes);
+        full_nodes = std::vector<bvh_node>();
+      }
+      return;
+    }
+
+    struct item { int node, compressed; aabb box; };
+    std::vector<bvh_compressed_node> result(1);
+    std::vector<item> stack{{0, 0, bounds}};
+    while (!stack.empty()) {
+      auto [index, c, box] = stack.back();
+      stack.pop_back();
+      const bvh_node& node = bvh_nodes[index];
+      for (int k = 1; k >= 0; k--) {
+        const bvh_node& child = bvh_nodes[node.left_first + k];
+        bvh_compressed_node::encode(box, child.bbox, result[c].lo[k], result[c].hi[k]);
+        if (child.is_leaf()) {
+          result[c].child[k] = -1 - child.left_first;
+          result[c].count[k] = uint16_t(child.primitives_count);
+        } else {
+          result[c].child[k] = int(result.size());
+          result[c].count[k] = 0;
+          stack.push_back({node.left_first + k, int(result.size()),
+                           bvh_compressed_node::decode(box, result[c].lo[k], result[c].hi[k])});
+          result.emplace_back();
+        }
+      }
+    }
+
+    compressed_count = int(result.size());
+    compressed_nodes = node_memory->allocate_array<bvh_compressed_node>(compressed_count);
+    std::copy(result.begin(), result.end(), compressed_nodes);
+    full_nodes = std::vector<bvh_node>();
+    bvh_nodes = nullptr;
+    nodes_used = 0;
+  }
+
+  // Node pool (slot 1 is unused) and primitive order, as serialized by the mesh cache. A
+  // compressed tree has no nodes to give.
+  const bvh_node* nodes() const { return bvh_nodes; }
+  int node_count() const { return nodes_used; }
+  const int* indices() const { return primitives_idx; }
  
 private:
+  std::unique_ptr<arena> own_memory; // when not given an arena
   mat4 inv_transform; // inverse transform
   aabb bounds; // in world space
   
   bvh_node* bvh_nodes = nullptr;
+  std::vector<bvh_node> full_nodes;  // where bvh_nodes are until compress(), with BVH_COMPRESS
+  bvh_compressed_node* compressed_nodes = nullptr;
+  int compressed_count = 0;
+  arena* node_memory = nullptr;
   T* primitives = nullptr;
   int* primitives_idx = nullptr;
-  int nodes_used;
-  int primitives_count;
+  int nodes_used = 0;
+  int primitives_count = 0;
+  unsigned flags = 0;
+  bool direct = false; // primitives are in leaf order, primitives_idx is the identity
   point3f center;
+  std::vector<aabb> boxes;         // of the primitives, only during build()
+  std::vector<point3f> centroids;
+
+  void allocate(arena* mem) {
+    if (mem == nullptr) {
+      own_memory = std::make_unique<arena>(sizeof(bvh_node) * primitives_count * 2 + sizeof(int) * primitives_count);
+      mem = own_memory.get();
+    }
+    node_memory = mem;
+    if (flags & BVH_COMPRESS) {
+      full_nodes.resize(primitives_count * 2);
+      bvh_nodes = full_nodes.data();
+    } else {
+      bvh_nodes = mem->allocate_array<bvh_node>(primitives_count * 2);
+    }
+    primitives_idx = mem->allocate_array<int>(primitives_count);
+  }
+
+  struct compressed_ref {
+    // A child on the traversal stack. Plain floats rather than an aabb, whose initialization
+    // would cost every hit() a pass over the whole stack.
+    int child;      // as in bvh_compressed_node
+    uint16_t count;
+    float bmin[3], bmax[3];  // decoded box
+
+    compressed_ref() = default;
+    compressed_ref(int _child, uint16_t _count, const aabb& b) : child{_child}, count{_count},
+      bmin{b.bmin[0], b.bmin[1], b.bmin[2]}, bmax{b.bmax[0], b.bmax[1], b.bmax[2]} {}
+
+    aabb box() const {
+      aabb b;
+      b.bmin = point3f(bmin[0], bmin[1], bmin[2]);
+      b.bmax = point3f(bmax[0], bmax[1], bmax[2]);
+      return b;
+    }
+  };
+
+  bool hit_compressed(const ray& r, interval ray_t, hit_record& rec) const {
+    // Same traversal as hit(), with the boxes decoded on the way down: the stack carries the
+    // decoded box of every child it holds, the one its children are quantized against.
+    compressed_ref node{0, 0, bounds}, stack[64];
+    int stack_ptr = 0;
+    auto closest_so_far = ray_t.max;
+    bool hit_anything = false;
+    RTW_STAT(auto& counters = stats::local());
+
+    while (true)
+    {
+      RTW_STAT(counters.bvh_nodes_visited++);
+      if (node.count > 0)
+      {
+        hit_record temp_rec;
+        RTW_STAT(counters.primitive_tests += node.count);
+
+        for (int first = -1 - node.child, i = 0; i < node.count; i++) {
+          T& primitive = direct ? primitives[first + i] : primitives[primitives_idx[first + i]];
+          if (primitive.hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
+            hit_anything = true;
+            closest_so_far = temp_rec.t;
+            rec = temp_rec;
+          }
+        }
+        if (stack_ptr == 0)
+          return hit_anything;
+        else node = stack[--stack_ptr];
+      } else {
+        const bvh_compressed_node& n = compressed_nodes[node.child];
+        aabb box = node.box();
+        aabb box1 = bvh_compressed_node::decode(box, n.lo[0], n.hi[0]);
+        aabb box2 = bvh_compressed_node::decode(box, n.lo[1], n.hi[1]);
+        double dist1 = box1.hit(r, interval(ray_t.min, closest_so_far));
+        double dist2 = box2.hit(r, interval(ray_t.min, closest_so_far));
+        compressed_ref child1{n.child[0], n.count[0], box1}, child2{n.child[1], n.count[1], box2};
+        RTW_STAT(counters.box_tests += 2);
+        if (dist1 > dist2) { std::swap( dist1, dist2 ); std::swap( child1, child2 ); }
+        if (dist1 == infinity)
+        {
+          if (stack_ptr == 0)
+            break;
+          else
+            node = stack[--stack_ptr];
+        }
+        else
+        {
+          node = child1;
+          if (dist2 != infinity)
+            stack[stack_ptr++] = child2;
+        }
+      }
+    }
+    return hit_anything;
+  }
+
+  bvh_quality compressed_quality() const {
+    // quality() of the tree as traversed, with the decoded, slightly larger boxes.
+    bvh_quality q;
+    std::vector<std::pair<compressed_ref, int>> stack{{{0, 0, bounds}, 0}};  // node, depth
+    while (!stack.empty()) {
+      auto [node, depth] = stack.back();
+      stack.pop_back();
+      if (node.count > 0) {
+        q.add_leaf(node.box(), depth, node.count);
+        continue;
+      }
+      const bvh_compressed_node& n = compressed_nodes[node.child];
+      aabb left = bvh_compressed_node::decode(node.box(), n.lo[0], n.hi[0]);
+      aabb right = bvh_compressed_node::decode(node.box(), n.lo[1], n.hi[1]);
+      q.add_interior(node.box(), depth, left, right);
+      stack.push_back({{n.child[0], n.count[0], left}, depth + 1});
+      stack.push_back({{n.child[1], n.count[1], right}, depth + 1});
+    }
+    q.memory = sizeof(bvh_compressed_node) * compressed_count + sizeof(int) * primitives_count;
+    q.finish(bounds);
+    return q;
+  }
+
+  aabb primitive_bounds(int i) const {
+    return boxes.empty() ? primitives[i].bounding_box() : boxes[i];
+  }
 
  
   void subdivide(int node_idx) {
@@ -203,7 +578,7 @@ private:
     int j = i + node.primitives_count - 1;
     while (i <= j)
     {
-      if (primitives[primitives_idx[i]].centroid()[axis] < split_pos)
+      if (centroids[primitives_idx[i]][axis] < split_pos)
         i++;
       else
         std::swap(primitives_idx[i], primitives_idx[j--]);
@@ -234,9 +609,9 @@ private:
     for (int first = node.left_first, i = 0; i < node.primitives_count; i++)
     {
       int leaf_prim_idx = primitives_idx[first + i];
-      T& leaf_prim = primitives[leaf_prim_idx];
-      node.bbox.bmin = fminf( node.bbox.bmin, leaf_prim.bounding_box().bmin );
-      node.bbox.bmax = fmaxf( node.bbox.bmax, leaf_prim.bounding_box().bmax );
+      aabb leaf_bounds = primitive_bounds(leaf_prim_idx);
+      node.bbox.bmin = fminf( node.bbox.bmin, leaf_bounds.bmin );
+      node.bbox.bmax = fmaxf( node.bbox.bmax, leaf_bounds.bmax );
     }
   }
 
@@ -245,19 +620,19 @@ private:
     for (int a = 0; a < 3; a++) {
       double bounds_min = infinity, bounds_max = -infinity;
       for (int i = 0; i < node.primitives_count; i++) {
-        T& primitive = primitives[primitives_idx[node.left_first + i]];
-        bounds_min = fmin(bounds_min, primitive.centroid()[a]);
-        bounds_max = fmax(bounds_max, primitive.centroid()[a]);
+        const point3f& centroid = centroids[primitives_idx[node.left_first + i]];
+        bounds_min = fmin(bounds_min, centroid[a]);
+        bounds_max = fmax(bounds_max, centroid[a]);
       }
       if (bounds_min == bounds_max) continue;
       // populate the bins
       bin bin[BINS];
       double scale = BINS / (bounds_max - bounds_min);
       for (int i = 0; i < node.primitives_count; i++) {
-          T& primitive = primitives[primitives_idx[node.left_first + i]];
-          int bin_idx = fmin(BINS - 1, (int)((primitive.centroid()[a] - bounds_min) * scale));
+          int primitive_idx = primitives_idx[node.left_first + i];
+          int bin_idx = fmin(BINS - 1, (int)((centroids[primitive_idx][a] - bounds_min) * scale));
           bin[bin_idx].primitives_count++;
-          bin[bin_idx].bounds = aabb(bin[bin_idx].bounds, primitive.bounding_box());
+          bin[bin_idx].bounds = aabb(bin[bin_idx].bounds, boxes[primitive_idx]);
       }
       // gather data for the 7 planes between the 8 bins
       double left_area[BINS - 1], right_area[BINS - 1];
@@ -302,6 +677,7 @@ public:
   {
     transform = _transform;
     inv_transform = transform.Inverted();
+    normal_transform = inv_transform.Transposed();
     // calculate world-space bounds using the new matrix
     vec3f bmin = bvh->bounding_box().bmin, bmax = bvh->bounding_box().bmax;
     bounds = aabb();
@@ -312,11 +688,16 @@ public:
     center = (bounds.bmax + bounds.bmin) / 2.0f;
   }
 
+  void set_index(int _index) { index = _index; }
+
   bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+    RTW_STAT(stats::local().instance_transforms++);
     // Change the ray from world space to object space
     auto origin = TransformPosition( r.origin(), inv_transform );
     auto direction = TransformVector( r.direction(), inv_transform );
-    ray rotated_r(origin, direction);
+    // The cone spread is scaled along with the direction, its starting width has to follow.
+    auto width_scale = sqrt(dot(direction, direction) / dot(r.direction(), r.direction()));
+    ray rotated_r(origin, direction, r.width() * width_scale, r.spread());
     
     // Determine where (if any) an intersection occurs in object space
     if (!bvh->hit(rotated_r, ray_t, rec))
@@ -325,11 +706,13 @@ public:
     // Change the intersection point from object space to world space
     auto p = TransformPosition(rec.p, transform);
     
-    // Change the normal from object space to world space
-    auto normal = TransformVector(rec.normal, transform);
+    // Change the normal from object space to world space. Normals take the inverse transpose,
+    // which keeps them perpendicular to scaled surfaces, and are made unit length again.
+    auto normal = TransformVector(rec.normal, normal_transform);
     
     rec.p = p;
-    rec.normal = normal;
+    rec.normal = unit_vector(vec3(normal));
+    rec.instance = index;
     
     return true;
   }
@@ -337,11 +720,16 @@ public:
   aabb bounding_box() const override { return bounds; }
   
   point3f centroid() const override { return center; }
+
+  const ::bvh<T>* blas() const { return bvh; }
+  const mat4& inverse_transform() const { return inv_transform; }
   
 private:
   bvh<T>* bvh = nullptr;
   mat4 transform; // inverse transform
   mat4 inv_transform; // inverse transform
+  mat4 normal_transform; // inverse transpose, for normals
+  int index = -1; // place among the scene's instances, reported as hit_record::instance
   aabb bounds; // in world space
   point3f center; // in world space
 };
@@ -5,15 +5,46 @@
 
 #include "color.h"
 #include "hittable.h"
+#include "image_output.h"
 #include "material.h"
+#include "sampler.h"
+#include "stats.h"
+#include "trace.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <vector>
 #include <future>
-#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+enum class heatmap_type {
+  none,        // a normal render
+  nodes,       // BVH and TLAS nodes visited per sample (needs RTW_STATS)
+  primitives,  // primitive intersection tests per sample (needs RTW_STATS)
+  time         // nanoseconds per sample
+};
+
+enum aov_flags : unsigned {
+  // Auxiliary outputs: what the camera rays hit first, for denoising and compositing
+  AOV_ALBEDO = 1 << 0,       // surface color, averaged over the samples
+  AOV_NORMAL = 1 << 1,       // shading normal in world space, averaged over the samples
+  AOV_DEPTH = 1 << 2,        // distance along the view direction, the nearest of the samples
+  AOV_MATERIAL_ID = 1 << 3,  // material::id, of the first sample
+  AOV_INSTANCE_ID = 1 << 4   // instance index, of the first sample; -1 for no instance
+};
+
+struct first_hit {
+  // What a camera ray hit first; per pixel, the albedo and normal of all samples summed up.
+  color albedo{0, 0, 0};
+  vec3 normal{0, 0, 0};
+  double depth = infinity;  // nothing hit
+  int material = -1;
+  int instance = -1;
+};
 
 class camera {
 public:
@@ -32,6 +63,15 @@ public:
   double defocus_angle{0};   // Variation angle of rays through each pixel
   double focus_dist{10};     // Distance from camera lookfrom to plane of perfect focus
   
+  sampler_type sampling{sampler_type::sobol};  // Sample generator for pixel, lens and scatter dimensions
+  uint64_t seed{0};                            // Seed of the sample generator
+  
+  heatmap_type heatmap{heatmap_type::none};  // Debug: write the cost of each pixel in false color
+  double heatmap_max{0};                     // Cost shown as the hottest color, 0 to pick one
+  
+  bool exr_half{true};  // OpenEXR output in half floats, else in 32 bit floats
+  unsigned aovs{0};     // aov_flags of the outputs besides the image
+  
   const char* out_path;
   
   void render(const hittable& world) {
@@ -40,74 +80,114 @@ public:
     using std::chrono::duration;
     using std::chrono::milliseconds;
     auto t1 = high_resolution_clock::now(); // measure render time
+    RTW_SPAN("render frame");
+    RTW_STAT(auto counted_before = stats::collect());
     
     initialize();
+#ifndef RTW_STATS
+    if (heatmap == heatmap_type::nodes || heatmap == heatmap_type::primitives)
+      std::clog << "WARNING: node and primitive heatmaps need RTW_STATS, showing time instead" << std::endl;
+#endif
     
-    std::vector<std::future<std::vector<color>>> buffers;
+    // Threads take bands of rows in turn and render every sample of their pixels. Finished bands
+    // go to the image file as soon as the bands above them are done; a heatmap is only known
+    // once the whole frame is.
+    output_frame out(*this);
+    bool streaming = heatmap == heatmap_type::none;
+    if (!out.open()) std::clog << "ERROR: Could not write image file " << out_path << std::endl;
+    std::vector<color> pixels(size_t(image_width) * image_height);
+    std::vector<first_hit> hits(aovs ? pixels.size() : 0);
+    int bands = (image_height + band_rows - 1) / band_rows;
+    std::atomic<int> next_band{0};
+    std::mutex written;
+    std::vector<bool> done(bands);
+    int bands_written = 0;
     
-    for (auto i = samples_per_pixel; i > 0; i--) {
-      buffers.push_back(std::async(std::bind(&camera::compute, this, std::cref(world))));
+    int workers = std::max(1, std::min<int>(bands, std::thread::hardware_concurrency()));
+    RTW_TRACE_ONLY(std::vector<trace::mark> worker_ends(workers));
+    std::vector<std::future<void>> threads;
+    for (int w = 0; w < workers; w++) {
+      threads.push_back(std::async(std::launch::async, [&, w] {
+        auto pixel_sampler = make_sampler(sampling, samples_per_pixel, image_width, image_height, seed);
+        for (int band; (band = next_band++) < bands;) {
+          render_band(world, *pixel_sampler, band, pixels, hits);
+          if (!streaming) continue;
+          std::lock_guard<std::mutex> lock(written);
+          done[band] = true;
+          for (; bands_written < bands && done[bands_written]; bands_written++)
+            out.write_band(pixels, hits, bands_written);
+        }
+        RTW_TRACE_ONLY(worker_ends[w] = trace::here());
+      }));
     }
     
-    auto samples = wait_for_all(buffers);
- 
-    std::vector<color> buffer(image_width * image_height);
-    for (auto& sample : samples) {
-      for (int p_sample = 0; p_sample < image_width * image_height; p_sample++) {
-        buffer[p_sample] += sample[p_sample];
-      }
-    }
+    RTW_TRACE_ONLY(auto wait_begin = trace::now());
+    for (auto& t : threads) t.get();
+    RTW_TRACE_ONLY(auto joined = trace::now());
+    RTW_TRACE_ONLY(trace::record("wait for bands", wait_begin, joined));
+    // Threads out of bands wait for the slowest one, unless another frame takes them.
+    RTW_TRACE_ONLY(for (auto& end : worker_ends) trace::record_idle(end, joined));
     
     auto t2 = high_resolution_clock::now();
     /* Getting number of milliseconds as a double. */
     duration<double, std::milli> ms_double = t2 - t1;
     std::clog << "Render time: " << ms_double.count() << "ms" << std::endl;
+    RTW_STAT(report_stats(counted_before, ms_double.count()));
     
-    if (!out_path) { // Write to standart output.
-      std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-
-      for (int j = 0; j < image_height; j++) {
-        for (int i = 0; i < image_width; i++) {
-          write_color(std::cout, buffer[i * image_height + j], samples_per_pixel);
-        }
-      }
-    } else { // Write to png.
-      unsigned char* data = (unsigned char*) malloc(sizeof(unsigned char) * 3 * image_width * image_height);
-      int idx = 0;
-      for (int j = 0; j < image_height; j++) {
-        for (int i = 0; i < image_width; i++) {
-          unsigned char r,g,b;
-          write_color(r, g, b, buffer[i * image_height + j], samples_per_pixel);
-          data[idx++] = r;
-          data[idx++] = g;
-          data[idx++] = b;
-        }
-      }
-      stbi_write_png(out_path, image_width, image_height, 3, data, 3 * image_width);
-      free(data);
+    if (!streaming) {
+      apply_heatmap(pixels);
+      for (int band = 0; band < bands; band++) out.write_band(pixels, hits, band);
     }
     
+    RTW_SPAN("write image");
+    if (!out.close()) std::clog << "ERROR: Could not write image file " << out_path << std::endl;
   }
   
-  std::vector<color> compute(const hittable& world) {
-    std::vector<color> buffer(image_width * image_height);
-    
-    for (int tile = 0; tile < image_width * image_height / 64; tile++) {
-      for (int v = 0; v < 8; v++) for (int u = 0; u < 8; u++) {
-        int x = tile % (image_width / 8), y = tile / (image_width / 8);
+  std::vector<ray> primary_rays(int samples) {
+    // The camera rays of every pixel, `samples` per pixel, for tools that trace rays of their own.
+    initialize();
+    std::vector<ray> rays;
+    auto pixel_sampler = make_sampler(sampling, samples, image_width, image_height, seed);
+    for (int s = 0; s < samples; s++)
+      for (int j = 0; j < image_height; j++)
+        for (int i = 0; i < image_width; i++) {
+          pixel_sampler->start_pixel_sample(i, j, s);
+          rays.push_back(get_ray(i, j, *pixel_sampler));
+        }
+    return rays;
+  }
+
+  void render_band(const hittable& world, sampler& pixel_sampler, int band, std::vector<color>& pixels,
+                   std::vector<first_hit>& hits) {
+    // Sums every sample of the pixels of `band` into `pixels` (row major), in 8x8 tiles, and
+    // their first hits into `hits` when there are AOVs.
+    RTW_SPAN("band", band);
+    int top = band * band_rows, bottom = std::min(top + band_rows, image_height);
+    for (int left = 0; left < image_width; left += 8) {
+      for (int b = top; b < bottom; b++) for (int a = left; a < std::min(left + 8, image_width); a++) {
         color pixel_color{0, 0, 0};
-        
-        int a = x * 8 + u;
-        int b = y * 8 + v;
-        
-        ray r = get_ray(a, b);
-        pixel_color += ray_color(r, max_depth, world);
- 
-        buffer[a * image_height + b] = pixel_color;
+        first_hit pixel_hit, sample_hit;
+        for (int sample = 0; sample < samples_per_pixel; sample++) {
+          // Every (pixel, sample) pair gets its own sample stream, so the image does not depend
+          // on thread count or scheduling.
+          pixel_sampler.start_pixel_sample(a, b, sample);
+          ray r = get_ray(a, b, pixel_sampler);
+          sample_hit = first_hit{};
+          auto first = aovs ? &sample_hit : nullptr;
+          if (heatmap == heatmap_type::none)
+            pixel_color += ray_color(r, max_depth, world, pixel_sampler, first);
+          else
+            pixel_color += color(path_cost(r, world, pixel_sampler, first), 0, 0);
+          if (!first) continue;
+          pixel_hit.albedo += sample_hit.albedo;
+          pixel_hit.normal += sample_hit.normal;
+          pixel_hit.depth = std::min(pixel_hit.depth, sample_hit.depth);
+          if (sample == 0) pixel_hit.material = sample_hit.material, pixel_hit.instance = sample_hit.instance;
+        }
+        pixels[size_t(b) * image_width + a] = pixel_color;
+        if (aovs) hits[size_t(b) * image_width + a] = pixel_hit;
       }
     }
- 
-    return buffer;
   }
   
 private:
@@ -119,6 +199,147 @@ private:
     vec3 u, v, w;         // Camera frame basis vectors
     vec3 defocus_disk_u;  // Defocus disk horiznotal radius
     vec3 defocus_disk_v;  // Defocus disk vertical radius
+    double pixel_spread_angle; // Angle covered by one pixel, the spread of primary ray cones
+  static constexpr int band_rows = 8;  // Rows a thread renders, and the file gets, at a time
+  
+  struct aov_layer {
+    unsigned flag;
+    const char* name;
+    std::vector<const char*> channels;
+    bool exact;  // never stored as half floats
+  };
+  
+  static const std::vector<aov_layer>& aov_layers() {
+    static const std::vector<aov_layer> layers{
+      {AOV_ALBEDO, "albedo", {"R", "G", "B"}, false},
+      {AOV_NORMAL, "normal", {"X", "Y", "Z"}, false},
+      {AOV_DEPTH, "depth", {"Z"}, true},
+      {AOV_MATERIAL_ID, "material", {"id"}, true},
+      {AOV_INSTANCE_ID, "instance", {"id"}, true}
+    };
+    return layers;
+  }
+  
+  float aov_value(unsigned flag, int channel, const first_hit& h) const {
+    // A channel of an AOV for a pixel whose samples were summed into `h`.
+    switch (flag) {
+      case AOV_ALBEDO: return float(h.albedo[channel] / samples_per_pixel);
+      case AOV_NORMAL: return float(h.normal[channel] / samples_per_pixel);
+      case AOV_DEPTH: return float(h.depth);
+      case AOV_MATERIAL_ID: return float(h.material);
+      default: return float(h.instance);
+    }
+  }
+  
+  class output_frame {
+    // Where the finished bands go, top to bottom: an image file of the type its extension names
+    // (.png, or linear .pfm or .exr), or plain PPM to standard output when there is no out_path.
+    // AOVs are layers of an EXR file, or PFM files next to other images (image.albedo.pfm for
+    // image.png).
+  public:
+    explicit output_frame(const camera& _cam) : cam{_cam} {}
+    
+    bool open() {
+      auto path = cam.out_path;
+      for (auto& layer : aov_layers())
+        if (cam.aovs & layer.flag) layers.push_back(&layer);
+      if (!path) {
+        if (!layers.empty()) std::clog << "WARNING: AOVs need an output file, leaving them out" << std::endl;
+        layers.clear();
+        std::cout << "P3\n" << cam.image_width << ' ' << cam.image_height << "\n255\n";
+        return true;
+      }
+      format = ends_with(path, ".exr") ? exr : ends_with(path, ".pfm") ? pfm : png;
+      if (format == exr) {
+        std::vector<exr_channel> channels{{"R", cam.exr_half}, {"G", cam.exr_half}, {"B", cam.exr_half}};
+        for (auto layer : layers)
+          for (auto c : layer->channels)
+            channels.push_back({std::string(layer->name) + "." + c, cam.exr_half && !layer->exact});
+        return exr_file.open(path, cam.image_width, cam.image_height, channels);
+      }
+      
+      bool ok = true;
+      auto dot = strrchr(path, '.');
+      std::string stem = dot ? std::string(path, dot) : std::string(path);
+      for (auto layer : layers) {
+        aov_files.push_back(std::make_unique<pfm_stream>());
+        auto aov_path = stem + "." + layer->name + ".pfm";
+        if (!aov_files.back()->open(aov_path.c_str(), cam.image_width, cam.image_height, int(layer->channels.size()))) {
+          std::clog << "ERROR: Could not write image file " << aov_path << std::endl;
+          ok = false;
+        }
+      }
+      if (format == pfm) return pfm_file.open(path, cam.image_width, cam.image_height) && ok;
+      return png_file.open(path, cam.image_width, cam.image_height) && ok;
+    }
+    
+    void write_band(const std::vector<color>& pixels, const std::vector<first_hit>& hits, int band) {
+      int top = band * band_rows, bottom = std::min(top + band_rows, cam.image_height);
+      size_t first = size_t(top) * cam.image_width, last = size_t(bottom) * cam.image_width;
+      if (!cam.out_path) {
+        for (auto p = first; p != last; ++p) write_color(std::cout, pixels[p], cam.samples_per_pixel);
+        return;
+      }
+      
+      if (format == exr) {
+        // EXR rows hold each channel in turn: the image, then the AOVs
+        values.clear();
+        for (size_t row = first; row < last; row += cam.image_width) {
+          for (int k = 0; k < 3; k++)
+            for (size_t p = row; p < row + cam.image_width; p++)
+              values.push_back(float(pixels[p][k] / cam.samples_per_pixel));
+          for (auto layer : layers)
+            for (int k = 0; k < int(layer->channels.size()); k++)
+              for (size_t p = row; p < row + cam.image_width; p++)
+                values.push_back(cam.aov_value(layer->flag, k, hits[p]));
+        }
+        exr_file.write_rows(values.data(), bottom - top);
+        return;
+      }
+      
+      for (size_t l = 0; l < layers.size(); l++) {
+        values.clear();
+        for (auto p = first; p != last; ++p)
+          for (int k = 0; k < int(layers[l]->channels.size()); k++)
+            values.push_back(cam.aov_value(layers[l]->flag, k, hits[p]));
+        aov_files[l]->write_rows(values.data(), bottom - top);
+      }
+      if (format == png) {
+        rgb.clear();
+        for (auto p = first; p != last; ++p) {
+          unsigned char r, g, b;
+          write_color(r, g, b, pixels[p], cam.samples_per_pixel);
+          rgb.insert(rgb.end(), {r, g, b});
+        }
+        png_file.write_rows(rgb.data(), bottom - top);
+        return;
+      }
+      
+      // The float files get the linear average of the samples, unclamped.
+      values.clear();
+      for (auto p = first; p != last; ++p)
+        for (int k = 0; k < 3; k++) values.push_back(float(pixels[p][k] / cam.samples_per_pixel));
+      pfm_file.write_rows(values.data(), bottom - top);
+    }
+    
+    bool close() {
+      if (!cam.out_path) return bool(std::cout.flush());
+      bool ok = true;
+      for (auto& f : aov_files) ok = f->close() && ok;
+      return (format == exr ? exr_file.close() : format == pfm ? pfm_file.close() : png_file.close()) && ok;
+    }
+    
+  private:
+    const camera& cam;
+    enum { png, pfm, exr } format = png;
+    std::vector<const aov_layer*> layers;  // the AOVs written, in aov_layers order
+    png_stream png_file;
+    pfm_stream pfm_file;
+    exr_stream exr_file;
+    std::vector<std::unique_ptr<pfm_stream>> aov_files;  // per layer, unless writing EXR
+    std::vector<uint8_t> rgb;
+    std::vector<float> values;
+  };
   
   void initialize() {
     image_height = static_cast<int>(image_width / aspect_ratio);
@@ -144,6 +365,7 @@ private:
     // Calculate the horizontal and vertical delta vectors from the pixel to pixel.
     pixel_delta_u = viewport_u / image_width;
     pixel_delta_v = viewport_v / image_height;
+    pixel_spread_angle = atan(2 * h / image_height);
     
     // Calculate the location of the upper left pixel.
     auto viewport_upper_left = center - (focus_dist * w) - viewport_u/2 - viewport_v/2;
@@ -155,51 +377,143 @@ private:
     defocus_disk_v = defocus_radius * v;
   }
   
-  ray get_ray(int i, int j) const {
+  double path_cost(const ray& r, const hittable& world, sampler& s, first_hit* first) {
+    // Traces the path of `r` for its cost instead of its color, in the unit of the heatmap.
+    auto start = std::chrono::steady_clock::now();
+    RTW_STAT(auto& counters = stats::local());
+    RTW_STAT(auto nodes = counters.bvh_nodes_visited + counters.tlas_nodes_visited);
+    RTW_STAT(auto tests = counters.primitive_tests);
+    ray_color(r, max_depth, world, s, first);
+    RTW_STAT(if (heatmap == heatmap_type::nodes) return double(counters.bvh_nodes_visited + counters.tlas_nodes_visited - nodes));
+    RTW_STAT(if (heatmap == heatmap_type::primitives) return double(counters.primitive_tests - tests));
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+  }
+
+  void apply_heatmap(std::vector<color>& buffer) const {
+    // Replaces the summed cost of every pixel by its false color, stored so that write_color's
+    // division by the sample count and gamma correction give the color back.
+    std::vector<double> costs(buffer.size());
+    for (size_t p = 0; p < buffer.size(); p++)
+      costs[p] = buffer[p].x() / samples_per_pixel;
+
+    // Unless given, the hottest color goes to the 99th percentile, so a few outliers do not
+    // leave everything else dark.
+    double top = heatmap_max;
+    if (top <= 0 && !costs.empty()) {
+      auto sorted = costs;
+      auto k = size_t(0.99 * (sorted.size() - 1));
+      std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+      top = sorted[k];
+    }
+    const char* unit = heatmap == heatmap_type::time ? "ns" : heatmap == heatmap_type::nodes ? "nodes" : "tests";
+#ifndef RTW_STATS
+    unit = "ns";
+#endif
+    std::clog << "Heatmap: 0 to " << top << " " << unit << " per sample" << std::endl;
+
+    for (size_t p = 0; p < buffer.size(); p++) {
+      auto c = false_color(top > 0 ? costs[p] / top : 0);
+      buffer[p] = double(samples_per_pixel) * c * c;
+    }
+  }
+
+  static color false_color(double x) {
+    // Dark blue through cyan, green and yellow to red, for x in [0,1].
+    static const color ramp[] = {
+      color(0.0, 0.0, 0.2), color(0.0, 0.5, 1.0), color(0.2, 0.9, 0.3), color(1.0, 0.8, 0.0), color(1.0, 0.1, 0.0)
+    };
+    x = interval(0, 1).clamp(x) * 4;
+    int i = std::min(int(x), 3);
+    auto t = x - i;
+    return (1 - t) * ramp[i] + t * ramp[i + 1];
+  }
+
+#ifdef RTW_STATS
+  void report_stats(const render_stats& before, double ms) const {
+    // The counts of this render only: the totals now, less the totals when it started.
+    auto counted = stats::collect();
+    counted -= before;
+    counted.print(std::clog);
+    if (auto path = getenv("RTW_STATS_JSON")) {
+      if (FILE* out = fopen(path, "a")) {
+        fprintf(out, "{\"image\": \"%s\", \"width\": %d, \"height\": %d, \"samples_per_pixel\": %d, "
+                "\"render_ms\": %.3f, \"stats\": %s}\n", out_path ? out_path : "", image_width,
+                image_height, samples_per_pixel, ms, counted.json().c_str());
+        fclose(out);
+      }
+    }
+  }
+#endif
+
+  ray get_ray(int i, int j, sampler& s) const {
     // Get a randomly-sampled camera ray for the pixel at location i,j originating from
     // the camera defocus disk.
     
     auto pixel_center = pixel00_loc + (i * pixel_delta_u) + (j * pixel_delta_v);
-    auto pixel_sample = pixel_center + pixel_sample_square();
+    auto pixel_sample = pixel_center + pixel_sample_square(s);
  
-    auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+    auto lens_sample = defocus_disk_sample(s);
+    auto ray_origin = (defocus_angle <= 0) ? center : lens_sample;
     auto ray_directioin = pixel_sample - ray_origin;
  
-    return ray{ray_origin, ray_directioin};
+    return ray{ray_origin, ray_directioin, 0, pixel_spread_angle};
   }
   
-  vec3 pixel_sample_square() const {
+  vec3 pixel_sample_square(sampler& s) const {
     // Returns a random point in the square surrounding a pixel at the origin.
-    auto px = -0.5 + random_double();
-    auto py = -0.5 + random_double();
+    auto u = s.get_2d();
+    auto px = -0.5 + u.x();
+    auto py = -0.5 + u.y();
     return (px * pixel_delta_u) + (py * pixel_delta_v);
   }
   
-  point3 defocus_disk_sample() const {
-    // Returns a random point in the camera defocus disk.
-    auto p = random_in_unit_disk();
+  point3 defocus_disk_sample(sampler& s) const {
+    // Returns a random point in the camera defocus disk. Always consumes its two dimensions,
+    // so the dimensions of the following bounces line up for every camera.
+    auto p = random_in_unit_disk(s.get_2d());
     return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
   }
     
-  color ray_color(const ray& r, int depth, const hittable& world) {
+  color ray_color(const ray& r, int depth, const hittable& world, sampler& s, first_hit* first = nullptr) {
+    // `first`, for camera rays only, gets what the ray hit.
     hit_record rec;
     
     // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (depth <= 0)
-        return color(0, 0, 0);
+    if (depth <= 0) {
+      RTW_STAT(stats::local().paths_cut++);
+      return color(0, 0, 0);
+    }
+    RTW_STAT(stats::local().rays[std::min(max_depth - depth, render_stats::max_bounces - 1)]++);
     
     // If the ray hits nothing, return the background color.
-    if (!world.hit(r, interval(0.001, infinity), rec))
+    if (!world.hit(r, interval(0.001, infinity), rec)) {
+      RTW_STAT(stats::local().paths_escaped++);
       return background;
+    }
+    if (first) {
+      // The hit the path needs anyway, so the AOVs cost no extra traversal.
+      first->albedo = rec.mat->albedo_at(rec);
+      first->normal = rec.normal;
+      first->depth = rec.t * dot(r.direction(), -w);
+      first->material = rec.mat->id;
+      first->instance = rec.instance;
+    }
             
     ray scattered;
     color attenuation;
-    color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+    color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.uv_footprint, rec.p);
     
-    if (!rec.mat->scatter(r, rec, attenuation, scattered))
+    if (!rec.mat->scatter(r, rec, attenuation, scattered, s)) {
+      RTW_STAT(stats::local().paths_absorbed++);
       return color_from_emission;
+    }
+    
+    // Carry the ray cone on: the bounce starts with the footprint width at the hit point. The
+    // spread is kept as is, which treats every bounce like a flat mirror.
+    scattered = ray(scattered.origin(), scattered.direction(), r.width_at(rec.t), r.spread());
 
-    color color_from_scatter = attenuation * ray_color(scattered, depth-1, world);
+    color color_from_scatter = attenuation * ray_color(scattered, depth-1, world, s);
 
     return color_from_emission + color_from_scatter;
   }
@@ -14,7 +14,9 @@ public:
   double t;
   double u;
   double v;
+  double uv_footprint = 0; // Width of the ray cone at the hit point in texture space
   bool front_face;
+  int instance = -1;       // Index of the model instance hit (see bvh_instance), -1 for other primitives
 
   void set_face_normal(const ray& r, const vec3& outward_normal) {
 	// Sets the hit record normal vector.
@@ -23,6 +25,13 @@ public:
 	front_face = dot(r.direction(), outward_normal) < 0;
 	normal = front_face ? outward_normal : -outward_normal;
   }
+
+  void set_uv_footprint(const ray& r, double uv_per_world) {
+	// Projects the ray cone onto the surface and scales it to texture space. The footprint is
+	// treated as isotropic: an ellipse of width w / cos has the area of a circle of w / sqrt(cos).
+	auto cos_theta = fabs(dot(unit_vector(r.direction()), normal));
+	uv_footprint = r.width_at(t) * uv_per_world / sqrt(fmax(cos_theta, 1e-3));
+  }
 };
 
 class hittable {
@@ -0,0 +1,459 @@
+#ifndef IMAGE_OUTPUT_H
+#define IMAGE_OUTPUT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <string>
+#include <vector>
+
+// Image files written a band of rows at a time, as the renderer finishes them, so that nothing
+// is left to encode once the last band is done and a file being written already shows the top
+// of the image. PNG holds the gamma corrected 8 bit image; PFM and OpenEXR hold linear floats,
+// light brighter than white included.
+
+class deflate_stream {
+  // Deflate (RFC 1951) with the fixed Huffman codes and greedy LZ77 matching over a 32 KB
+  // window, fed in pieces. Every piece becomes a block of its own and matches reach back into
+  // earlier pieces, so compression barely depends on how the input is cut.
+public:
+  deflate_stream() : head(hash_size, -1) {}
+
+  void compress(const uint8_t* data, size_t n, bool last, std::vector<uint8_t>& out) {
+    // Appends the compressed piece to `out`, all of it but the last few bits, which go out
+    // with the next piece (or with the final one).
+    window.insert(window.end(), data, data + n);
+    put_bits(last ? 1 : 0, 1);
+    put_bits(1, 2);  // fixed Huffman codes
+    size_t i = window.size() - n;
+    while (i < window.size()) {
+      int length = 0;
+      int64_t distance = 0;
+      if (i + 3 <= window.size()) {
+        auto h = hash(&window[i]);
+        int64_t candidate = head[h];
+        head[h] = base + int64_t(i);
+        distance = base + int64_t(i) - candidate;
+        if (candidate >= base && distance <= max_distance)
+          length = match_length(size_t(candidate - base), i);
+      }
+      if (length < 3) {
+        put_symbol(window[i++]);
+        continue;
+      }
+      put_match(length, int(distance));
+      for (size_t k = i + 1; k < i + length && k + 3 <= window.size(); k++)
+        head[hash(&window[k])] = base + int64_t(k);
+      i += length;
+    }
+    put_symbol(256);  // end of block
+    if (last) put_bits(0, (8 - bit_count) % 8);
+    out.insert(out.end(), bytes.begin(), bytes.end());
+    bytes.clear();
+
+    // Keep the last 32 KB for the matches of the next piece
+    if (window.size() > max_distance) {
+      auto drop = window.size() - max_distance;
+      window.erase(window.begin(), window.begin() + drop);
+      base += int64_t(drop);
+    }
+  }
+
+private:
+  static constexpr int hash_bits = 15;
+  static constexpr size_t hash_size = size_t(1) << hash_bits;
+  static constexpr int64_t max_distance = 32768;
+  static constexpr int max_length = 258;
+
+  std::vector<uint8_t> window;  // input from max_distance before the current piece on
+  std::vector<int64_t> head;    // by hash of 3 bytes, the last position they were seen at
+  int64_t base = 0;             // position of window[0] in the whole input
+  std::vector<uint8_t> bytes;   // output of the current piece
+  uint32_t bits = 0;            // less than a byte of output, least significant bit first
+  int bit_count = 0;
+
+  static size_t hash(const uint8_t* p) {
+    uint32_t v = uint32_t(p[0]) << 16 | uint32_t(p[1]) << 8 | p[2];
+    return (v * 2654435761u) >> (32 - hash_bits);
+  }
+
+  int match_length(size_t from, size_t to) const {
+    int limit = int(std::min<size_t>(max_length, window.size() - to));
+    int n = 0;
+    while (n < limit && window[from + n] == window[to + n]) n++;
+    return n;
+  }
+
+  void put_bits(uint32_t value, int count) {
+    bits |= value << bit_count;
+    bit_count += count;
+    while (bit_count >= 8) {
+      bytes.push_back(uint8_t(bits));
+      bits >>= 8, bit_count -= 8;
+    }
+  }
+
+  void put_code(uint32_t code, int length) {
+    // Huffman codes go out most significant bit first
+    uint32_t reversed = 0;
+    for (int b = 0; b < length; b++) reversed |= ((code >> b) & 1) << (length - 1 - b);
+    put_bits(reversed, length);
+  }
+
+  void put_symbol(int symbol) {
+    // The fixed literal/length code of RFC 1951, 3.2.6
+    if (symbol < 144) put_code(0x30 + symbol, 8);
+    else if (symbol < 256) put_code(0x190 + symbol - 144, 9);
+    else if (symbol < 280) put_code(symbol - 256, 7);
+    else put_code(0xc0 + symbol - 280, 8);
+  }
+
+  void put_match(int length, int distance) {
+    static const int length_base[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+      35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const int length_extra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+      3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const int distance_base[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+      193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static const int distance_extra[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7,
+      8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+    int l = int(std::upper_bound(std::begin(length_base), std::end(length_base), length) - std::begin(length_base)) - 1;
+    put_symbol(257 + l);
+    put_bits(length - length_base[l], length_extra[l]);
+    int d = int(std::upper_bound(std::begin(distance_base), std::end(distance_base), distance) - std::begin(distance_base)) - 1;
+    put_code(d, 5);
+    put_bits(distance - distance_base[d], distance_extra[d]);
+  }
+};
+
+class png_stream {
+  // 8 bit RGB PNG, written as rows come in: every band of rows is filtered, compressed and
+  // written out as an IDAT chunk right away.
+public:
+  png_stream() = default;
+  png_stream(const png_stream&) = delete;
+  png_stream& operator=(const png_stream&) = delete;
+  ~png_stream() { if (file) fclose(file); }
+
+  bool open(const char* path, int _width, int _height) {
+    width = _width, height = _height;
+    file = fopen(path, "wb");
+    if (file == nullptr) return false;
+    static const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    fwrite(signature, 1, sizeof(signature), file);
+    std::vector<uint8_t> header;
+    put_u32(header, width);
+    put_u32(header, height);
+    header.insert(header.end(), {8, 2, 0, 0, 0});  // 8 bits, RGB, deflate, adaptive filters, no interlace
+    write_chunk("IHDR", header);
+    previous.assign(3 * size_t(width), 0);
+    std::vector<uint8_t> zlib_header{0x78, 0x01};
+    compressed = zlib_header;
+    return true;
+  }
+
+  void write_rows(const uint8_t* rgb, int rows) {
+    // `rows` rows of 3 * width bytes, the next ones from the top.
+    if (file == nullptr) return;
+    size_t stride = 3 * size_t(width);
+    std::vector<uint8_t> filtered;
+    filtered.reserve(rows * (stride + 1));
+    for (int y = 0; y < rows; y++, rows_written++) {
+      filter_row(rgb + y * stride, filtered);
+      std::copy(rgb + y * stride, rgb + (y + 1) * stride, previous.begin());
+    }
+    adler(filtered.data(), filtered.size());
+    deflate.compress(filtered.data(), filtered.size(), false, compressed);
+    write_chunk("IDAT", compressed);
+    compressed.clear();
+    fflush(file);
+  }
+
+  bool close() {
+    // Ends the compressed stream and the file; false if anything failed to write.
+    if (file == nullptr) return false;
+    deflate.compress(nullptr, 0, true, compressed);
+    put_u32(compressed, (adler_b << 16) | adler_a);
+    write_chunk("IDAT", compressed);
+    write_chunk("IEND", {});
+    bool ok = rows_written == height && !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    file = nullptr;
+    return ok;
+  }
+
+private:
+  FILE* file = nullptr;
+  int width = 0, height = 0;
+  int rows_written = 0;
+  std::vector<uint8_t> previous;    // the last row written, unfiltered
+  std::vector<uint8_t> compressed;  // zlib stream not written yet
+  deflate_stream deflate;
+  uint32_t adler_a = 1, adler_b = 0;
+
+  void filter_row(const uint8_t* row, std::vector<uint8_t>& out) {
+    // Picks the filter with the smallest sum of absolute differences, the usual heuristic.
+    size_t stride = 3 * size_t(width);
+    auto paeth = [](int a, int b, int c) {
+      int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+      return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+    };
+    auto predict = [&](int filter, size_t i) -> int {
+      int a = i >= 3 ? row[i - 3] : 0, b = previous[i], c = i >= 3 ? previous[i - 3] : 0;
+      switch (filter) {
+        case 1: return a;
+        case 2: return b;
+        case 3: return (a + b) / 2;
+        case 4: return paeth(a, b, c);
+        default: return 0;
+      }
+    };
+    int best = 0;
+    long best_sum = -1;
+    for (int filter = 0; filter < 5; filter++) {
+      long sum = 0;
+      for (size_t i = 0; i < stride; i++) sum += abs(int8_t(uint8_t(row[i] - predict(filter, i))));
+      if (best_sum < 0 || sum < best_sum) best = filter, best_sum = sum;
+    }
+    out.push_back(uint8_t(best));
+    for (size_t i = 0; i < stride; i++) out.push_back(uint8_t(row[i] - predict(best, i)));
+  }
+
+  void adler(const uint8_t* data, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      adler_a = (adler_a + data[i]) % 65521;
+      adler_b = (adler_b + adler_a) % 65521;
+    }
+  }
+
+  static void put_u32(std::vector<uint8_t>& out, uint32_t v) {
+    out.insert(out.end(), {uint8_t(v >> 24), uint8_t(v >> 16), uint8_t(v >> 8), uint8_t(v)});
+  }
+
+  static uint32_t crc(const uint8_t* data, size_t n, uint32_t c = 0xffffffffu) {
+    static const auto table = [] {
+      std::vector<uint32_t> t(256);
+      for (uint32_t i = 0; i < 256; i++) {
+        uint32_t v = i;
+        for (int k = 0; k < 8; k++) v = v & 1 ? 0xedb88320u ^ (v >> 1) : v >> 1;
+        t[i] = v;
+      }
+      return t;
+    }();
+    for (size_t i = 0; i < n; i++) c = table[(c ^ data[i]) & 0xff] ^ (c >> 8);
+    return c;
+  }
+
+  void write_chunk(const char* type, const std::vector<uint8_t>& data) {
+    std::vector<uint8_t> length;
+    put_u32(length, uint32_t(data.size()));
+    fwrite(length.data(), 1, 4, file);
+    fwrite(type, 1, 4, file);
+    if (!data.empty()) fwrite(data.data(), 1, data.size(), file);
+    uint32_t c = crc(reinterpret_cast<const uint8_t*>(type), 4);
+    c = crc(data.data(), data.size(), c) ^ 0xffffffffu;
+    std::vector<uint8_t> check;
+    put_u32(check, c);
+    fwrite(check.data(), 1, 4, file);
+  }
+};
+
+inline void put_u32_le(std::vector<uint8_t>& out, uint32_t v) {
+  out.insert(out.end(), {uint8_t(v), uint8_t(v >> 8), uint8_t(v >> 16), uint8_t(v >> 24)});
+}
+
+inline void put_float_le(std::vector<uint8_t>& out, float f) {
+  uint32_t v;
+  memcpy(&v, &f, 4);
+  put_u32_le(out, v);
+}
+
+inline uint16_t float_to_half(float f) {
+  // IEEE half, rounded to nearest even; too large goes to infinity, too small to subnormals
+  // and zero.
+  uint32_t x;
+  memcpy(&x, &f, 4);
+  uint16_t sign = uint16_t((x >> 16) & 0x8000);
+  uint32_t mantissa = x & 0x7fffff;
+  int exponent = int((x >> 23) & 0xff);
+  if (exponent == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);  // infinity, NaN
+  exponent -= 127 - 15;
+  if (exponent >= 31) return sign | 0x7c00;
+  if (exponent <= 0) {
+    if (exponent < -10) return sign;
+    mantissa |= 0x800000;
+    int shift = 14 - exponent;
+    uint32_t half = mantissa >> shift, rest = mantissa & ((1u << shift) - 1), middle = 1u << (shift - 1);
+    if (rest > middle || (rest == middle && (half & 1))) half++;
+    return sign | uint16_t(half);
+  }
+  uint32_t half = uint32_t(exponent) << 10 | mantissa >> 13, rest = mantissa & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;  // may carry into the exponent
+  return sign | uint16_t(half);
+}
+
+class pfm_stream {
+  // Linear RGB, or a single channel, as 32 bit floats. PFM stores the bottom row first, so
+  // every band is written at its place counted from the end of the file.
+public:
+  pfm_stream() = default;
+  pfm_stream(const pfm_stream&) = delete;
+  pfm_stream& operator=(const pfm_stream&) = delete;
+  ~pfm_stream() { if (file) fclose(file); }
+
+  bool open(const char* path, int _width, int _height, int _channels = 3) {
+    width = _width, height = _height, channels = _channels;
+    file = fopen(path, "wb");
+    if (file == nullptr) return false;
+    // Negative scale: little endian
+    header = fprintf(file, "%s\n%d %d\n-1.0\n", channels == 1 ? "Pf" : "PF", width, height);
+    return header > 0;
+  }
+
+  void write_rows(const float* values, int rows) {
+    // `rows` rows of channels * width floats, the next ones from the top.
+    if (file == nullptr) return;
+    std::vector<uint8_t> row;
+    size_t stride = size_t(channels) * width;
+    for (int y = 0; y < rows; y++, rows_written++) {
+      row.clear();
+      for (size_t i = 0; i < stride; i++) put_float_le(row, values[y * stride + i]);
+      fseek(file, long(header + (height - 1 - rows_written) * row.size()), SEEK_SET);
+      fwrite(row.data(), 1, row.size(), file);
+    }
+    fflush(file);
+  }
+
+  bool close() {
+    if (file == nullptr) return false;
+    bool ok = rows_written == height && !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    file = nullptr;
+    return ok;
+  }
+
+private:
+  FILE* file = nullptr;
+  int width = 0, height = 0, channels = 3;
+  int rows_written = 0;
+  long header = 0;  // bytes before the pixels
+};
+
+struct exr_channel {
+  std::string name;  // e.g. R, or albedo.R for a channel of the albedo layer
+  bool half;         // half float, else 32 bit float
+};
+
+class exr_stream {
+  // OpenEXR scanline image, uncompressed, with any channels. One row per chunk, so the offset
+  // table is known before the first row and rows go out as they come.
+public:
+  exr_stream() = default;
+  exr_stream(const exr_stream&) = delete;
+  exr_stream& operator=(const exr_stream&) = delete;
+  ~exr_stream() { if (file) fclose(file); }
+
+  bool open(const char* path, int _width, int _height, const std::vector<exr_channel>& _channels) {
+    width = _width, height = _height, channels = _channels;
+    file = fopen(path, "wb");
+    if (file == nullptr) return false;
+
+    // The file lists channels by name, and so stores every row's channels in that order.
+    order.resize(channels.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return channels[a].name < channels[b].name; });
+
+    std::vector<uint8_t> h{0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0};  // magic, version 2 scanline
+    std::vector<uint8_t> list;
+    for (int c : order) {
+      list.insert(list.end(), channels[c].name.begin(), channels[c].name.end());
+      list.push_back(0);
+      put_u32_le(list, channels[c].half ? 1 : 2);  // pixel type HALF or FLOAT
+      put_u32_le(list, 0);             // pLinear and reserved
+      put_u32_le(list, 1);             // x and y sampling
+      put_u32_le(list, 1);
+    }
+    list.push_back(0);
+    attribute(h, "channels", "chlist", list);
+    attribute(h, "compression", "compression", {0});
+    std::vector<uint8_t> window;
+    for (uint32_t v : {0u, 0u, uint32_t(width - 1), uint32_t(height - 1)}) put_u32_le(window, v);
+    attribute(h, "dataWindow", "box2i", window);
+    attribute(h, "displayWindow", "box2i", window);
+    attribute(h, "lineOrder", "lineOrder", {0});  // increasing y
+    std::vector<uint8_t> one, center;
+    put_float_le(one, 1);
+    put_float_le(center, 0), put_float_le(center, 0);
+    attribute(h, "pixelAspectRatio", "float", one);
+    attribute(h, "screenWindowCenter", "v2f", center);
+    attribute(h, "screenWindowWidth", "float", one);
+    h.push_back(0);
+
+    uint64_t offset = h.size() + 8 * uint64_t(height);
+    for (int y = 0; y < height; y++, offset += 8 + row_bytes()) {
+      put_u32_le(h, uint32_t(offset));
+      put_u32_le(h, uint32_t(offset >> 32));
+    }
+    fwrite(h.data(), 1, h.size(), file);
+    return true;
+  }
+
+  void write_rows(const float* values, int rows) {
+    // `rows` rows of width values of every channel in turn, in the order given to open, the
+    // next ones from the top.
+    if (file == nullptr) return;
+    std::vector<uint8_t> chunk;
+    for (int y = 0; y < rows; y++, rows_written++) {
+      chunk.clear();
+      put_u32_le(chunk, uint32_t(rows_written));
+      put_u32_le(chunk, uint32_t(row_bytes()));
+      const float* row = values + size_t(y) * channels.size() * width;
+      for (int c : order) {
+        for (int x = 0; x < width; x++) {
+          float v = row[size_t(c) * width + x];
+          if (channels[c].half) {
+            auto bits = float_to_half(v);
+            chunk.insert(chunk.end(), {uint8_t(bits), uint8_t(bits >> 8)});
+          }
+          else put_float_le(chunk, v);
+        }
+      }
+      fwrite(chunk.data(), 1, chunk.size(), file);
+    }
+    fflush(file);
+  }
+
+  bool close() {
+    if (file == nullptr) return false;
+    bool ok = rows_written == height && !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    file = nullptr;
+    return ok;
+  }
+
+private:
+  FILE* file = nullptr;
+  int width = 0, height = 0;
+  std::vector<exr_channel> channels;
+  int rows_written = 0;
+  std::vector<int> order;  // channels by name
+
+  size_t row_bytes() const {
+    size_t bytes = 0;
+    for (auto& c : channels) bytes += size_t(width) * (c.half ? 2 : 4);
+    return bytes;
+  }
+
+  static void attribute(std::vector<uint8_t>& out, const char* name, const char* type, const std::vector<uint8_t>& value) {
+    out.insert(out.end(), name, name + strlen(name) + 1);
+    out.insert(out.end(), type, type + strlen(type) + 1);
+    put_u32_le(out, uint32_t(value.size()));
+    out.insert(out.end(), value.begin(), value.end());
+  }
+};
+
+#endif
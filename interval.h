@@ -16,7 +16,7 @@ public:
 		return min <= x && x <= max;
 	}
 
-	bool surrounds(double x) {
+	bool surrounds(double x) const {
 		return min < x && x < max;
 	}
   
@@ -0,0 +1,78 @@
+#include "rtweekend.h"
+
+#include "mesh.h"
+#include "obj_loader.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include <assimp/Importer.hpp>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+
+// Load time of an OBJ file with the native loader and with Assimp.
+// usage: tiny-ray-tracer-load-bench [file.obj] [runs]
+//
+// The Assimp time only covers Importer::ReadFile with the flags model uses, not the conversion
+// into a mesh, so it is a lower bound of what loading through Assimp costs.
+
+template<typename F>
+std::vector<double> time_runs(int runs, F&& load) {
+  std::vector<double> ms;
+  for (int i = 0; i < runs; i++) {
+    auto t1 = std::chrono::high_resolution_clock::now();
+    load();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - t1;
+    ms.push_back(elapsed.count());
+  }
+  std::sort(ms.begin(), ms.end());
+  return ms;
+}
+
+void report(const char* name, const std::vector<double>& ms) {
+  printf("%-8s min %9.2f ms   median %9.2f ms\n", name, ms.front(), ms[ms.size() / 2]);
+}
+
+int main(int argc, char** argv) {
+  const char* path = argc > 1 ? argv[1] : "assets/dragon.obj";
+  int runs = argc > 2 ? std::max(1, atoi(argv[2])) : 5;
+
+  size_t vertices = 0, triangles = 0;
+  bool loaded = true;
+  auto native = time_runs(runs, [&] {
+    mesh geometry;
+    std::vector<material_desc> materials;
+    loaded = obj_loader::load(path, geometry, materials) && loaded;
+    vertices = geometry.positions.size();
+    triangles = geometry.triangle_count();
+  });
+  if (!loaded) {
+    fprintf(stderr, "Could not load %s\n", path);
+    return 1;
+  }
+
+  size_t assimp_vertices = 0, assimp_triangles = 0;
+  auto assimp = time_runs(runs, [&] {
+    Assimp::Importer import;
+    import.SetPropertyInteger(AI_CONFIG_PP_SBP_REMOVE, aiPrimitiveType_LINE | aiPrimitiveType_POINT);
+    const aiScene* scene = import.ReadFile(path,
+                     aiProcess_Triangulate            |
+                     aiProcess_JoinIdenticalVertices  |
+                     aiProcess_SortByPType);
+    assimp_vertices = assimp_triangles = 0;
+    for (unsigned int i = 0; scene != nullptr && i < scene->mNumMeshes; i++) {
+      assimp_vertices += scene->mMeshes[i]->mNumVertices;
+      assimp_triangles += scene->mMeshes[i]->mNumFaces;
+    }
+  });
+
+  printf("%s, %d runs\n", path, runs);
+  printf("native   %zu vertices, %zu triangles\n", vertices, triangles);
+  printf("assimp   %zu vertices, %zu triangles\n", assimp_vertices, assimp_triangles);
+  report("native", native);
+  report("assimp", assimp);
+  printf("speedup  %.1fx\n", assimp[assimp.size() / 2] / native[native.size() / 2]);
+  return 0;
+}
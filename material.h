@@ -3,19 +3,41 @@
 
 #include "rtweekend.h"
 #include "texture.h"
+#include "sampler.h"
+#include "onb.h"
 
 class hit_record;
 
 class material {
 public:
+  int id = -1;  // Number within the scene, for the material ID output, see material_numbering
+
   virtual ~material() = default;
   
-  virtual color emitted(double u, double v, const point3& p) const {
+  virtual color emitted(double u, double v, double footprint, const point3& p) const {
     return color(0,0,0);
   }
   
   virtual bool scatter(
-      const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const = 0;
+      const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s) const = 0;
+
+  virtual color albedo_at(const hit_record&) const {
+    // The surface color at `rec` for the albedo output, which denoisers take as a guide. Clear
+    // and unknown surfaces count as white.
+    return color(1,1,1);
+  }
+};
+
+class material_numbering {
+  // Numbers materials in the order a scene registers them, from 0 in every scene, so that the
+  // material ID output only depends on the scene. A material keeps the first number it gets.
+public:
+  void add(material& m) {
+    if (m.id < 0) m.id = next++;
+  }
+
+private:
+  int next = 0;
 };
 
 class lambertian : public material {
@@ -23,19 +45,21 @@ public:
   lambertian(const color& a) : albedo(make_shared<solid_color>(a)) {}
   lambertian(shared_ptr<texture> a) : albedo(a) {}
   
-  bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
+  bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s)
   const override {
-    auto scatter_direction = rec.normal + random_unit_vector();
-    
-    // Catch degenerate scatter direction
-    if (scatter_direction.near_zero())
-        scatter_direction = rec.normal;
+    // Cosine-weighted direction around the normal, never degenerate.
+    onb uvw(rec.normal);
+    auto scatter_direction = uvw.local(random_cosine_direction(s.get_2d()));
     
     scattered = ray(rec.p, scatter_direction);
-    attenuation = albedo->value(rec.u, rec.v, rec.p);
+    attenuation = albedo->filtered_value(rec.u, rec.v, rec.uv_footprint, rec.p);
     
     return true;
   }
+
+  color albedo_at(const hit_record& rec) const override {
+    return albedo->filtered_value(rec.u, rec.v, rec.uv_footprint, rec.p);
+  }
 private:
   shared_ptr<texture> albedo;
 };
@@ -44,13 +68,15 @@ class metal : public material {
 public:
   metal(const color& a, double f) : albedo{a}, fuzz{f < 1 ? f : 1} {}
   
-  bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
+  bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s)
   const override {
     vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-    scattered = ray(rec.p, reflected + fuzz*random_unit_vector());
+    scattered = ray(rec.p, reflected + fuzz*random_unit_vector(s.get_2d()));
     attenuation = albedo;
     return (dot(scattered.direction(), rec.normal) > 0 );
   }
+
+  color albedo_at(const hit_record&) const override { return albedo; }
 private:
   color albedo;
   double fuzz;
@@ -60,7 +86,7 @@ class dielectric : public material {
 public:
   dielectric(double index_of_refraction) : ir{index_of_refraction} {}
   
-  bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
+  bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s)
   const override {
     attenuation = color{1.0, 1.0, 1.0};
     double refraction_ratio = rec.front_face ? (1.0/ir) : ir;
@@ -72,7 +98,7 @@ public:
     bool cannot_refract = refraction_ratio * sin_theta > 1.0;
     vec3 direction;
 
-    if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+    if (cannot_refract || reflectance(cos_theta, refraction_ratio) > s.get_1d())
       direction = reflect(unit_direction, rec.normal);
     else
       direction = refract(unit_direction, rec.normal, refraction_ratio);
@@ -99,14 +125,20 @@ public:
   diffuse_light(shared_ptr<texture> a) : emit(a) {}
   diffuse_light(color c) : emit(make_shared<solid_color>(c)) {}
   
-  bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
+  bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s)
   const override {
     return false;
   }
   
   
-  color emitted(double u, double v, const point3& p) const override {
-    return emission_intensity * emit->value(u, v, p);
+  color emitted(double u, double v, double footprint, const point3& p) const override {
+    return emission_intensity * emit->filtered_value(u, v, footprint, p);
+  }
+
+  color albedo_at(const hit_record& rec) const override {
+    // The color of the light, as bright as white at most
+    auto c = emit->filtered_value(rec.u, rec.v, rec.uv_footprint, rec.p);
+    return color(fmin(c.x(), 1), fmin(c.y(), 1), fmin(c.z(), 1));
   }
   
 private:
@@ -123,22 +155,24 @@ public:
  
   pbr() =default;
 
-  bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
+  bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s)
   const override {
-    auto scatter_direction = rec.normal + random_unit_vector();
-    
-    // Catch degenerate scatter direction
-    if (scatter_direction.near_zero())
-        scatter_direction = rec.normal;
+    // Cosine-weighted direction around the normal, never degenerate.
+    onb uvw(rec.normal);
+    auto scatter_direction = uvw.local(random_cosine_direction(s.get_2d()));
     
     scattered = ray(rec.p, scatter_direction);
-    attenuation = albedo->value(rec.u, rec.v, rec.p);
+    attenuation = albedo->filtered_value(rec.u, rec.v, rec.uv_footprint, rec.p);
     
     return true;
   }
   
-  color emitted(double u, double v, const point3& p) const override {
-    return emission_intensity * emit->value(u, v, p);
+  color emitted(double u, double v, double footprint, const point3& p) const override {
+    return emission_intensity * emit->filtered_value(u, v, footprint, p);
+  }
+
+  color albedo_at(const hit_record& rec) const override {
+    return albedo->filtered_value(rec.u, rec.v, rec.uv_footprint, rec.p);
   }
 };
 
@@ -0,0 +1,108 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "triangle.h"
+
+#include <vector>
+
+// Indexed triangle mesh. Vertex attributes are stored once, in single precision, and shared by
+// all the triangles using them; every triangle is three indices into the attribute arrays.
+
+class mesh {
+public:
+  std::vector<point3f> positions;
+  std::vector<vec3f> normals;             // one per position, or empty
+  std::vector<float> uvs;                 // two per position, or empty
+  std::vector<uint32_t> indices;          // three per triangle
+  std::vector<uint32_t> material_ids;     // one per triangle, into materials
+  std::vector<shared_ptr<material>> materials;
+
+  int triangle_count() const { return int(indices.size() / 3); }
+
+  size_t size_in_bytes() const {
+    return positions.size() * sizeof(point3f) + normals.size() * sizeof(vec3f)
+      + uvs.size() * sizeof(float) + indices.size() * sizeof(uint32_t)
+      + material_ids.size() * sizeof(uint32_t);
+  }
+};
+
+class mesh_triangle : public hittable {
+  // One triangle of a mesh. Bounds and centroid are computed from the shared vertices when asked
+  // for, which only happens while building or refitting a BVH.
+public:
+  mesh_triangle() = default;
+  mesh_triangle(const mesh* _owner, uint32_t _index) : owner{_owner}, index{_index} {}
+
+  aabb bounding_box() const override {
+    aabb bbox;
+    for (int k = 0; k < 3; k++) {
+      bbox.bmin = fminf(bbox.bmin, vertex(k));
+      bbox.bmax = fmaxf(bbox.bmax, vertex(k));
+    }
+    return bbox.pad();
+  }
+
+  point3f centroid() const override {
+    point3 v1 = vertex(0), v2 = vertex(1), v3 = vertex(2);
+    return 0.3333333333333 * (v1 + v2 + v3);
+  }
+
+  bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+    const uint32_t* tri = &owner->indices[3 * size_t(index)];
+    point3 v1 = owner->positions[tri[0]];
+    point3 v2 = owner->positions[tri[1]];
+    point3 v3 = owner->positions[tri[2]];
+
+    double t, u, v;
+    bool hit = triangle::intersect_triangle(r, v1, v2, v3, t, u, v);
+    if (!hit || !ray_t.surrounds(t)) {
+      return false;
+    }
+
+    // Interpolated vertex normal, or the face normal if the mesh has none
+    vec3 normal;
+    if (!owner->normals.empty()) {
+      normal = (1 - u - v) * vec3(owner->normals[tri[0]])
+        + u * vec3(owner->normals[tri[1]])
+        + v * vec3(owner->normals[tri[2]]);
+    }
+    if (normal.near_zero())
+      normal = unit_vector(cross(v2 - v1, v3 - v1));
+    else
+      normal = unit_vector(normal);
+
+    vec2 uv1, uv2, uv3;
+    if (!owner->uvs.empty()) {
+      const float* uvs = owner->uvs.data();
+      uv1 = vec2(uvs[2*tri[0]], uvs[2*tri[0] + 1]);
+      uv2 = vec2(uvs[2*tri[1]], uvs[2*tri[1] + 1]);
+      uv3 = vec2(uvs[2*tri[2]], uvs[2*tri[2] + 1]);
+    }
+
+    rec.t = t;
+    rec.p = r.at(rec.t);
+    rec.set_face_normal(r, normal);
+    rec.u = uv1.x() * (1 - u - v) + uv2.x() * u + uv3.x() * v;
+    rec.v = uv1.y() * (1 - u - v) + uv2.y() * u + uv3.y() * v;
+    rec.mat = owner->materials[owner->material_ids[index]];
+
+    // texture space area over world space area gives the texel density for mip selection
+    auto world_area = cross(v2 - v1, v3 - v1).length();
+    auto duv1 = uv2 - uv1, duv2 = uv3 - uv1;
+    auto uv_area = fabs(duv1.x() * duv2.y() - duv2.x() * duv1.y());
+    rec.set_uv_footprint(r, world_area > 0 ? sqrt(uv_area / world_area) : 0);
+    return true;
+  }
+
+  uint32_t triangle_index() const { return index; }
+
+private:
+  const mesh* owner = nullptr;
+  uint32_t index = 0;  // triangle index in the owner mesh
+
+  const point3f& vertex(int k) const { return owner->positions[owner->indices[3 * size_t(index) + k]]; }
+};
+
+#endif
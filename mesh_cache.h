@@ -0,0 +1,371 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include "rtweekend.h"
+#include "color.h"
+#include "mesh.h"
+#include "bvh.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <filesystem>
+
+// Binary cache of a loaded model, written next to the asset as `<asset>.trtcache`. It holds the
+// indexed mesh, the material table and the built BVH, laid out so that a warm start reads the
+// file in one go and copies the sections out without parsing anything or rebuilding the BVH:
+//
+//   header | materials | libraries | positions | normals | uvs | indices | material ids
+//          | bvh nodes | primitive indices | strings
+//
+// Every section starts on a 64 byte boundary. The cache is dropped and rebuilt when the size or
+// modification time of the asset, or of any MTL library an OBJ asset names, change, or when the
+// format version or node layout differ, or when an index in it is out of range. Numbers are
+// stored in native byte order. Set RTW_MESH_CACHE=0 to neither read nor write caches.
+
+// How a loader describes a material, before any texture is opened.
+struct texture_desc {
+  enum source_type : uint32_t { none, solid, image };
+  source_type source = none;
+  color value;      // for solid
+  std::string path; // for image, relative to the model directory
+};
+
+struct material_desc {
+  std::string name;
+  texture_desc diffuse;
+  texture_desc emissive;
+};
+
+struct mesh_cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t node_size;     // sizeof(bvh_node) of the writer
+  uint64_t source_size;
+  int64_t source_mtime;
+  uint32_t triangle_count;
+  uint32_t vertex_count;
+  uint32_t normal_count;  // vertex_count, or 0 without normals
+  uint32_t uv_count;      // vertex_count, or 0 without texture coordinates
+  uint32_t material_count;
+  uint32_t node_count;
+  uint32_t string_bytes;
+  uint32_t library_count; // MTL libraries the materials came from
+};
+
+struct cached_texture {
+  uint32_t source;
+  float value[3];
+  uint32_t path_offset, path_length;
+};
+
+struct cached_material {
+  uint32_t name_offset, name_length;
+  cached_texture diffuse, emissive;
+};
+
+struct cached_library {
+  uint32_t path_offset, path_length;  // as named by the OBJ, relative to its directory
+  uint64_t size;                      // missing_library if the file did not exist
+  int64_t mtime;
+};
+
+class mesh_cache {
+public:
+  static constexpr char magic[8] = {'T', 'R', 'T', 'C', 'A', 'C', 'H', 'E'};
+  static constexpr uint32_t version = 4;  // 4: stamps of the MTL libraries
+
+  static std::string path_for(const std::string& asset) { return asset + ".trtcache"; }
+
+  static bool enabled() {
+    auto env = getenv("RTW_MESH_CACHE");
+    return env == nullptr || strcmp(env, "0") != 0;
+  }
+
+  mesh_cache(const std::string& asset) {
+    // Reads the cache of `asset`. valid() tells whether it exists and is up to date.
+    uint64_t size;
+    int64_t mtime;
+    if (!enabled() || !source_stamp(asset, size, mtime) || !read(path_for(asset))) return;
+
+    if (contents.size() < sizeof(mesh_cache_header)) return;
+    auto& h = header();
+    sections = layout(h);
+    is_valid = memcmp(h.magic, magic, sizeof(magic)) == 0
+      && h.version == version
+      && h.node_size == sizeof(bvh_node)
+      && h.source_size == size && h.source_mtime == mtime
+      && (h.normal_count == 0 || h.normal_count == h.vertex_count)
+      && (h.uv_count == 0 || h.uv_count == h.vertex_count)
+      && sections.total <= contents.size()
+      && libraries_unchanged(asset)
+      && in_range();
+  }
+
+  mesh_cache(const mesh_cache&) = delete;
+  mesh_cache& operator=(const mesh_cache&) = delete;
+
+  bool valid() const { return is_valid; }
+
+  const mesh_cache_header& header() const {
+    return *reinterpret_cast<const mesh_cache_header*>(data);
+  }
+
+  std::vector<material_desc> materials() const {
+    auto cached = reinterpret_cast<const cached_material*>(data + sections.materials);
+    std::vector<material_desc> result(header().material_count);
+    for (size_t i = 0; i < result.size(); i++) {
+      result[i].name = string_at(cached[i].name_offset, cached[i].name_length);
+      result[i].diffuse = texture_at(cached[i].diffuse);
+      result[i].emissive = texture_at(cached[i].emissive);
+    }
+    return result;
+  }
+
+  const point3f* positions() const { return reinterpret_cast<const point3f*>(data + sections.positions); }
+  const vec3f* normals() const { return reinterpret_cast<const vec3f*>(data + sections.normals); }
+  const float* uvs() const { return reinterpret_cast<const float*>(data + sections.uvs); }
+  const uint32_t* indices() const { return reinterpret_cast<const uint32_t*>(data + sections.indices); }
+  const uint32_t* material_ids() const { return reinterpret_cast<const uint32_t*>(data + sections.material_ids); }
+
+  const bvh_node* nodes() const {
+    return reinterpret_cast<const bvh_node*>(data + sections.nodes);
+  }
+
+  const int* primitives_idx() const {
+    return reinterpret_cast<const int*>(data + sections.primitives_idx);
+  }
+
+  static bool write(
+    const std::string& asset, const std::vector<material_desc>& materials,
+    const mesh& geometry, const bvh<mesh_triangle>& accel)
+  {
+    // Writes the cache of `asset` to a temporary file and moves it into place, so readers never
+    // see a partially written cache. Returns false if the cache could not be written.
+    mesh_cache_header h{};
+    memcpy(h.magic, magic, sizeof(magic));
+    h.version = version;
+    h.node_size = sizeof(bvh_node);
+    if (!enabled() || !source_stamp(asset, h.source_size, h.source_mtime)) return false;
+    h.triangle_count = geometry.triangle_count();
+    h.vertex_count = uint32_t(geometry.positions.size());
+    h.normal_count = uint32_t(geometry.normals.size());
+    h.uv_count = uint32_t(geometry.uvs.size() / 2);
+    h.material_count = uint32_t(materials.size());
+    h.node_count = accel.node_count();
+
+    std::string strings;
+    std::vector<cached_material> cached_materials(materials.size());
+    for (size_t i = 0; i < materials.size(); i++) {
+      add_string(strings, materials[i].name, cached_materials[i].name_offset, cached_materials[i].name_length);
+      cached_materials[i].diffuse = cache_texture(strings, materials[i].diffuse);
+      cached_materials[i].emissive = cache_texture(strings, materials[i].emissive);
+    }
+    auto names = material_libraries(asset);
+    std::vector<cached_library> libraries(names.size());
+    for (size_t i = 0; i < names.size(); i++) {
+      add_string(strings, names[i], libraries[i].path_offset, libraries[i].path_length);
+      library_stamp(directory_of(asset) + names[i], libraries[i].size, libraries[i].mtime);
+    }
+    h.library_count = uint32_t(libraries.size());
+    h.string_bytes = uint32_t(strings.size());
+
+    auto s = layout(h);
+    std::vector<unsigned char> file(s.total, 0);
+    memcpy(file.data(), &h, sizeof(h));
+    copy_section(file, s.materials, cached_materials.data(), cached_materials.size() * sizeof(cached_material));
+    copy_section(file, s.libraries, libraries.data(), libraries.size() * sizeof(cached_library));
+    copy_section(file, s.positions, geometry.positions.data(), geometry.positions.size() * sizeof(point3f));
+    copy_section(file, s.normals, geometry.normals.data(), geometry.normals.size() * sizeof(vec3f));
+    copy_section(file, s.uvs, geometry.uvs.data(), geometry.uvs.size() * sizeof(float));
+    copy_section(file, s.indices, geometry.indices.data(), geometry.indices.size() * sizeof(uint32_t));
+    copy_section(file, s.material_ids, geometry.material_ids.data(), geometry.material_ids.size() * sizeof(uint32_t));
+    copy_section(file, s.nodes, accel.nodes(), size_t(h.node_count) * sizeof(bvh_node));
+    copy_section(file, s.primitives_idx, accel.indices(), size_t(h.triangle_count) * sizeof(int));
+    copy_section(file, s.strings, strings.data(), strings.size());
+
+    auto path = path_for(asset);
+    auto temporary = path + ".tmp";
+    FILE* out = fopen(temporary.c_str(), "wb");
+    if (out == nullptr) {
+      std::clog << "WARNING: Could not write mesh cache " << path << std::endl;
+      return false;
+    }
+    bool written = fwrite(file.data(), 1, file.size(), out) == file.size();
+    written = fclose(out) == 0 && written;
+    std::error_code error;
+    if (written) std::filesystem::rename(temporary, path, error);
+    if (!written || error) {
+      std::filesystem::remove(temporary, error);
+      std::clog << "WARNING: Could not write mesh cache " << path << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+private:
+  struct section_offsets {
+    size_t materials, libraries, positions, normals, uvs, indices, material_ids, nodes, primitives_idx, strings, total;
+  };
+
+  std::vector<unsigned char> contents;
+  const unsigned char* data = nullptr;
+  section_offsets sections{};
+  bool is_valid = false;
+
+  static size_t align64(size_t offset) { return (offset + 63) & ~size_t(63); }
+
+  static void copy_section(std::vector<unsigned char>& file, size_t offset, const void* source, size_t bytes) {
+    // Empty sections may come from empty vectors, whose data() can be null, which memcpy forbids.
+    if (bytes > 0) memcpy(file.data() + offset, source, bytes);
+  }
+
+  static section_offsets layout(const mesh_cache_header& h) {
+    section_offsets s;
+    s.materials = align64(sizeof(mesh_cache_header));
+    s.libraries = align64(s.materials + size_t(h.material_count) * sizeof(cached_material));
+    s.positions = align64(s.libraries + size_t(h.library_count) * sizeof(cached_library));
+    s.normals = align64(s.positions + size_t(h.vertex_count) * sizeof(point3f));
+    s.uvs = align64(s.normals + size_t(h.normal_count) * sizeof(vec3f));
+    s.indices = align64(s.uvs + size_t(h.uv_count) * 2 * sizeof(float));
+    s.material_ids = align64(s.indices + size_t(h.triangle_count) * 3 * sizeof(uint32_t));
+    s.nodes = align64(s.material_ids + size_t(h.triangle_count) * sizeof(uint32_t));
+    s.primitives_idx = align64(s.nodes + size_t(h.node_count) * sizeof(bvh_node));
+    s.strings = align64(s.primitives_idx + size_t(h.triangle_count) * sizeof(int));
+    s.total = s.strings + h.string_bytes;
+    return s;
+  }
+
+  static bool source_stamp(const std::string& asset, uint64_t& size, int64_t& mtime) {
+    std::error_code error;
+    size = std::filesystem::file_size(asset, error);
+    if (error) return false;
+    mtime = std::filesystem::last_write_time(asset, error).time_since_epoch().count();
+    return !error;
+  }
+
+  static constexpr uint64_t missing_library = UINT64_MAX;
+
+  static void library_stamp(const std::string& path, uint64_t& size, int64_t& mtime) {
+    // A library that does not exist is stamped too, so that creating it later is a change.
+    if (!source_stamp(path, size, mtime)) size = missing_library, mtime = 0;
+  }
+
+  static std::string directory_of(const std::string& asset) {
+    return asset.substr(0, asset.find_last_of('/') + 1);
+  }
+
+  static std::vector<std::string> material_libraries(const std::string& asset) {
+    // The mtllib names of an OBJ asset, read the way obj_loader reads them. Other formats name
+    // none that the cache knows of.
+    std::vector<std::string> names;
+    auto dot = asset.find_last_of('.');
+    if (dot == std::string::npos) return names;
+    auto extension = asset.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if (extension != "obj") return names;
+
+    std::ifstream in(asset);
+    const char* spaces = " \t\r";
+    for (std::string line; std::getline(in, line);) {
+      auto start = line.find_first_not_of(spaces);
+      if (start == std::string::npos || line.compare(start, 6, "mtllib") != 0) continue;
+      auto name = line.find_first_not_of(spaces, start + 6);
+      if (name == start + 6 || name == std::string::npos) continue;  // not followed by a space
+      names.push_back(line.substr(name, line.find_last_not_of(spaces) + 1 - name));
+    }
+    return names;
+  }
+
+  bool libraries_unchanged(const std::string& asset) const {
+    auto libraries = reinterpret_cast<const cached_library*>(data + sections.libraries);
+    for (uint32_t i = 0; i < header().library_count; i++) {
+      uint64_t size;
+      int64_t mtime;
+      library_stamp(directory_of(asset) + string_at(libraries[i].path_offset, libraries[i].path_length), size, mtime);
+      if (size != libraries[i].size || mtime != libraries[i].mtime) return false;
+    }
+    return true;
+  }
+
+  bool in_range() const {
+    // A damaged cache must not send lookups outside the mesh or the BVH. Triangles index the
+    // vertices and the material table (UINT32_MAX for faces without a material). Nodes point at
+    // children further down the array, leaves at a range of primitives_idx, which holds
+    // triangles. Slot 1 of the nodes is unused.
+    auto& h = header();
+    auto triangle_indices = indices();
+    for (size_t i = 0; i < 3 * size_t(h.triangle_count); i++)
+      if (triangle_indices[i] >= h.vertex_count) return false;
+    auto ids = material_ids();
+    for (uint32_t i = 0; i < h.triangle_count; i++)
+      if (ids[i] >= h.material_count && ids[i] != UINT32_MAX) return false;
+
+    if (h.triangle_count == 0) return h.node_count == 0;
+    if (h.node_count == 0 || h.node_count > 2 * size_t(h.triangle_count)) return false;
+    auto cached_nodes = nodes();
+    for (uint32_t i = 0; i < h.node_count; i++) {
+      if (i == 1) continue;
+      auto& node = cached_nodes[i];
+      if (node.primitives_count < 0 || node.left_first < 0) return false;
+      if (node.is_leaf() && size_t(node.left_first) + node.primitives_count > h.triangle_count) return false;
+      if (!node.is_leaf() && (uint32_t(node.left_first) <= i || uint32_t(node.left_first) + 1 >= h.node_count))
+        return false;
+    }
+    auto primitives = primitives_idx();
+    for (uint32_t i = 0; i < h.triangle_count; i++)
+      if (primitives[i] < 0 || uint32_t(primitives[i]) >= h.triangle_count) return false;
+    return true;
+  }
+
+  static void add_string(std::string& strings, const std::string& s, uint32_t& offset, uint32_t& length) {
+    offset = uint32_t(strings.size());
+    length = uint32_t(s.size());
+    strings += s;
+  }
+
+  static cached_texture cache_texture(std::string& strings, const texture_desc& desc) {
+    cached_texture c{};
+    c.source = desc.source;
+    for (int k = 0; k < 3; k++) c.value[k] = float(desc.value[k]);
+    add_string(strings, desc.path, c.path_offset, c.path_length);
+    return c;
+  }
+
+  std::string string_at(uint32_t offset, uint32_t length) const {
+    if (size_t(offset) + length > header().string_bytes) return {};
+    return std::string(reinterpret_cast<const char*>(data + sections.strings + offset), length);
+  }
+
+  texture_desc texture_at(const cached_texture& c) const {
+    texture_desc desc;
+    desc.source = texture_desc::source_type(c.source);
+    desc.value = color(c.value[0], c.value[1], c.value[2]);
+    desc.path = string_at(c.path_offset, c.path_length);
+    return desc;
+  }
+
+  bool read(const std::string& path) {
+    // One read of the whole file; the sections are copied out of it afterwards.
+    FILE* in = fopen(path.c_str(), "rb");
+    if (in == nullptr) return false;
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    if (size > 0) {
+      contents.resize(size);
+      if (fread(contents.data(), 1, size, in) == size_t(size))
+        data = contents.data();
+      else
+        contents.clear();
+    }
+    fclose(in);
+    return data != nullptr;
+  }
+};
+
+#endif
@@ -0,0 +1,215 @@
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "color.h"
+#include "scene.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Times the intersection kernels one at a time, single threaded, on rays taken from a scene:
+// the camera rays of every pixel ("primary") and rays leaving the surfaces they hit in uniformly
+// random directions ("random"), like the bounces of a diffuse scene.
+// usage: tiny-ray-tracer-microbench [scene] [--width N] [--save FILE] [--rays FILE] [--ms N]
+//
+// --save writes the ray sets to FILE and --rays reads them back instead of generating them, so
+// that different builds can be compared on exactly the same rays. Kernels that need geometry the
+// scene does not have are skipped: sphere kernels need spheres, the mesh kernels (aabb,
+// triangle, bvh, instance) need a model instance and tlas needs more than one instance. Mesh
+// kernels run in the object space of the first instance; triangle also needs the mesh of a
+// model behind it.
+
+struct ray_set {
+  const char* name;
+  std::vector<ray> rays;
+};
+
+std::vector<ray> random_rays(const hittable& world, const std::vector<ray>& primary) {
+  // From the hit point of each primary ray that hits something, a ray in a random direction
+  // away from the surface, like a diffuse bounce
+  std::vector<ray> rays;
+  rng directions(1);
+  for (auto& r : primary) {
+    hit_record rec;
+    if (!world.hit(r, interval(0.001, infinity), rec)) continue;
+    auto u = vec2(directions.next_double(), directions.next_double());
+    auto direction = random_unit_vector(u);
+    if (dot(direction, rec.normal) < 0) direction = -direction;
+    rays.push_back(ray(rec.p, direction));
+  }
+  return rays;
+}
+
+std::vector<ray> to_object_space(const std::vector<ray>& rays, const mat4& inverse) {
+  std::vector<ray> result;
+  for (auto& r : rays)
+    result.push_back(ray(TransformPosition(r.origin(), inverse), TransformVector(r.direction(), inverse)));
+  return result;
+}
+
+bool save_rays(const std::string& path, const std::vector<ray_set>& sets) {
+  // magic, then per set: ray count and origin, direction, cone width and spread of every ray
+  FILE* out = fopen(path.c_str(), "wb");
+  if (out == nullptr) return false;
+  fwrite("TRTRAYS1", 1, 8, out);
+  for (auto& set : sets) {
+    uint64_t count = set.rays.size();
+    fwrite(&count, sizeof(count), 1, out);
+    for (auto& r : set.rays) {
+      double values[8] = {r.origin().x(), r.origin().y(), r.origin().z(),
+        r.direction().x(), r.direction().y(), r.direction().z(), r.width(), r.spread()};
+      fwrite(values, sizeof(values), 1, out);
+    }
+  }
+  return fclose(out) == 0;
+}
+
+bool load_rays(const std::string& path, std::vector<ray_set>& sets) {
+  FILE* in = fopen(path.c_str(), "rb");
+  if (in == nullptr) return false;
+  char magic[8];
+  bool ok = fread(magic, 1, 8, in) == 8 && memcmp(magic, "TRTRAYS1", 8) == 0;
+  for (auto& set : sets) {
+    uint64_t count = 0;
+    ok = ok && fread(&count, sizeof(count), 1, in) == 1;
+    set.rays.clear();
+    for (uint64_t i = 0; ok && i < count; i++) {
+      double v[8];
+      ok = fread(v, sizeof(v), 1, in) == 1;
+      set.rays.push_back(ray(point3(v[0], v[1], v[2]), vec3(v[3], v[4], v[5]), v[6], v[7]));
+    }
+  }
+  fclose(in);
+  return ok;
+}
+
+double min_ms = 200;
+volatile size_t sink;
+
+template<typename F>
+void run(const char* kernel, const ray_set& set, F&& test) {
+  // Repeats the kernel over the whole set until at least min_ms have passed.
+  if (set.rays.empty()) return;
+  size_t hits = 0, passes = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  double ms;
+  do {
+    for (auto& r : set.rays) hits += test(r) ? 1 : 0;
+    passes++;
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+    ms = elapsed.count();
+  } while (ms < min_ms);
+  sink = hits;
+
+  double n = double(passes) * set.rays.size();
+  printf("%-10s %-8s %10.2f ns/ray %10.2f Mrays/s %7.1f%% hit\n",
+         kernel, set.name, ms * 1e6 / n, n / (ms * 1e3), 100.0 * hits / n);
+}
+
+int main(int argc, char** argv) {
+  std::string scene_path = "scenes/dragon.scene", save_path, rays_path;
+  int width = 256;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--width" && has_value) width = atoi(argv[++i]);
+    else if (arg == "--save" && has_value) save_path = argv[++i];
+    else if (arg == "--rays" && has_value) rays_path = argv[++i];
+    else if (arg == "--ms" && has_value) min_ms = atof(argv[++i]);
+    else scene_path = arg;
+  }
+
+  scene s;
+  if (!s.load(scene_path)) return 1;
+  s.build();
+
+  std::vector<ray_set> sets{{"primary", {}}, {"random", {}}};
+  if (!rays_path.empty()) {
+    if (!load_rays(rays_path, sets)) {
+      std::clog << "ERROR: Could not read rays from " << rays_path << std::endl;
+      return 1;
+    }
+  } else {
+    s.cam.image_width = width;
+    sets[0].rays = s.cam.primary_rays(1);
+    sets[1].rays = random_rays(s.world, sets[0].rays);
+  }
+  if (!save_path.empty() && !save_rays(save_path, sets)) {
+    std::clog << "ERROR: Could not write rays to " << save_path << std::endl;
+    return 1;
+  }
+
+  printf("%s: %zu primary and %zu random rays\n", scene_path.c_str(), sets[0].rays.size(), sets[1].rays.size());
+  const interval range(0.001, infinity);
+
+  // The triangle kernel reads the mesh of the model behind the first instance's BVH
+  const mesh* geometry = nullptr;
+  if (s.instance_count > 0) {
+    for (auto& [name, m] : s.models)
+      if (&m->blas == s.instance_list[0].blas()) geometry = &m->geometry;
+    if (geometry == nullptr)
+      std::clog << "The first instance has no model mesh, skipping the triangle kernel" << std::endl;
+  }
+
+  for (auto& set : sets) {
+    if (s.sphere_count > 0) {
+      size_t k = 0;
+      run("sphere", set, [&](const ray& r) {
+        hit_record rec;
+        return s.sphere_list[k++ % s.sphere_count].hit(r, range, rec);
+      });
+      run("bvh<sph>", set, [&](const ray& r) {
+        hit_record rec;
+        return s.sphere_bvh->hit(r, range, rec);
+      });
+    }
+
+    if (s.instance_count > 0) {
+      auto& instance = s.instance_list[0];
+      auto blas = instance.blas();
+      ray_set local{set.name, to_object_space(set.rays, instance.inverse_transform())};
+
+      // Boxes and triangles are taken in turn, so most tests miss, like most tests in a traversal
+      size_t k = 0;
+      if (blas->node_count() > 0) {  // none left in a compressed BVH
+        run("aabb", local, [&](const ray& r) {
+          auto node = k++ % blas->node_count();
+          if (node == 1) node = 0;  // unused, the children of a node are always a pair
+          return blas->nodes()[node].bbox.hit(r, range) != infinity;
+        });
+      }
+
+      if (geometry != nullptr && geometry->triangle_count() > 0) {
+        auto triangles = size_t(geometry->triangle_count());
+        k = 0;
+        run("triangle", local, [&](const ray& r) {
+          auto tri = &geometry->indices[3 * (k++ % triangles)];
+          point3 v1 = geometry->positions[tri[0]], v2 = geometry->positions[tri[1]], v3 = geometry->positions[tri[2]];
+          double t, u, v;
+          return triangle::intersect_triangle(r, v1, v2, v3, t, u, v) && range.surrounds(t);
+        });
+      }
+
+      run("bvh", local, [&](const ray& r) {
+        hit_record rec;
+        return blas->hit(r, range, rec);
+      });
+      run("instance", set, [&](const ray& r) {
+        hit_record rec;
+        return instance.hit(r, range, rec);
+      });
+    }
+
+    if (s.instance_tlas) {
+      run("tlas", set, [&](const ray& r) {
+        hit_record rec;
+        return s.instance_tlas->hit(r, range, rec);
+      });
+    }
+  }
+  return 0;
+}
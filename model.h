@@ -3,7 +3,11 @@
 
 #include "material.h"
 #include "texture.h"
-#include "triangle.h"
+#include "mesh.h"
+#include "bvh.h"
+#include "arena.h"
+#include "mesh_cache.h"
+#include "obj_loader.h"
 
 #include <vector>
 #include <string>
@@ -18,27 +22,62 @@ using std::vector;
 using std::string;
 
 class model {
+  // Declared first so that it is released last: everything below may live in it.
+  std::unique_ptr<arena> own_memory;
+  arena* memory;
+
 public:
-  triangle* primitives;
+  mesh geometry;  // shared vertex and index buffers of all the model's meshes
+  mesh_triangle* primitives = nullptr;
   int primitives_count = 0;
+  bvh<mesh_triangle> blas;  // over primitives, built on load or read back from the mesh cache
   
   std::map<std::string, shared_ptr<material>> materials_loaded;
   std::map<std::string, shared_ptr<texture>> textures_loaded;  // stores all the textures loaded so far,
                                                                   // optimization to make sure textures aren't loaded more than once.
 
 
-  // constructor, expects a filepath to a 3D model.
-  model(const char* path) {
+  // constructor, expects a filepath to a 3D model. Primitives, BVH and materials are allocated
+  // from `mem` if given (which then has to outlive the model), or from an arena of the model's own.
+  // `blas_flags` are added to the build flags of the BVH, e.g. BVH_COMPRESS. The materials are
+  // numbered by `numbering` if given (the scene's), or from 0 within the model.
+  model(const char* path, arena* mem = nullptr, unsigned blas_flags = 0, material_numbering* numbering = nullptr)
+    : memory{mem} {
+    if (memory == nullptr) {
+      own_memory = std::make_unique<arena>();
+      memory = own_memory.get();
+    }
     
-    default_diffuse = make_shared<checker_texture>(0.32, color(.2,  .3, .1), color(.9, .9, .9));
-    default_emissive = make_shared<solid_color>(0, 0, 0);
-    default_mat = make_shared<lambertian>(default_diffuse);
-    load_model(path);
+    default_diffuse = memory->make_shared<checker_texture>(0.32, color(.2,  .3, .1), color(.9, .9, .9));
+    default_emissive = memory->make_shared<solid_color>(0, 0, 0);
+    default_mat = memory->make_shared<lambertian>(default_diffuse);
+    
+    RTW_SPAN("load model");
+    string asset{path};
+    directory = asset.substr(0, asset.find_last_of('/'));
+    if (load_cache(asset, blas_flags)) {
+      std::clog << "Loaded " << asset << " from " << mesh_cache::path_for(asset) << std::endl;
+      RTW_STAT(blas.quality().print(std::clog, "BVH"));
+    } else {
+      load_model(asset);
+      create_primitives();
+      if (primitives_count > 0 && (blas_flags & BVH_COMPRESS)) {
+        // The cache keeps full nodes: build them on the side, then adopt them compressed.
+        bvh<mesh_triangle> full(primitives, primitives_count, nullptr, BVH_REORDER_PRIMITIVES);
+        renumber_triangles();
+        mesh_cache::write(asset, material_table, geometry, full);
+        blas = bvh<mesh_triangle>(primitives, primitives_count, full.nodes(), full.node_count(), full.indices(), memory, blas_flags);
+      } else if (primitives_count > 0) {
+        blas = bvh<mesh_triangle>(primitives, primitives_count, memory, BVH_REORDER_PRIMITIVES | blas_flags);
+        renumber_triangles();
+        mesh_cache::write(asset, material_table, geometry, blas);
+      }
+    }
+    build_materials(numbering);
   }
 
-  ~model() {
-    delete [] primitives;
-  }
+  model(const model&) = delete;
+  model& operator=(const model&) = delete;
 
 private:
   string directory;
@@ -46,9 +85,68 @@ private:
   shared_ptr<texture> default_diffuse;
   shared_ptr<texture> default_emissive;
   shared_ptr<material> default_mat;
+  
+  // Materials as described by the file; geometry.material_ids index into it. Textures and
+  // materials are only created from these once loading is done.
+  vector<material_desc> material_table;
+  
+  bool load_cache(const string& path, unsigned blas_flags) {
+    RTW_SPAN("mesh cache read");
+    mesh_cache cache{path};
+    if (!cache.valid()) return false;
+    
+    auto& h = cache.header();
+    material_table = cache.materials();
+    geometry.positions.assign(cache.positions(), cache.positions() + h.vertex_count);
+    geometry.normals.assign(cache.normals(), cache.normals() + h.normal_count);
+    geometry.uvs.assign(cache.uvs(), cache.uvs() + 2 * size_t(h.uv_count));
+    geometry.indices.assign(cache.indices(), cache.indices() + 3 * size_t(h.triangle_count));
+    geometry.material_ids.assign(cache.material_ids(), cache.material_ids() + h.triangle_count);
+    create_primitives();
+    blas = bvh<mesh_triangle>(primitives, primitives_count, cache.nodes(), h.node_count, cache.primitives_idx(), memory, blas_flags);
+    return true;
+  }
+  
+  void create_primitives() {
+    primitives_count = geometry.triangle_count();
+    primitives = memory->create_array<mesh_triangle>(primitives_count);
+    for (int i = 0; i < primitives_count; i++)
+      primitives[i] = mesh_triangle(&geometry, i);
+    std::clog << "Mesh memory: " << geometry.size_in_bytes() / 1024 << " KB for "
+      << geometry.positions.size() << " vertices and " << primitives_count << " triangles" << std::endl;
+  }
 
-  // loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
+  void renumber_triangles() {
+    // Puts the triangles of the mesh in the order of the primitives, which the BVH left in leaf
+    // order, so that a leaf also reads its vertex indices from one run of memory. The mesh cache
+    // then saves them in this order too.
+    vector<uint32_t> indices(geometry.indices.size()), material_ids(geometry.material_ids.size());
+    for (int i = 0; i < primitives_count; i++) {
+      auto t = primitives[i].triangle_index();
+      std::copy_n(&geometry.indices[3 * size_t(t)], 3, &indices[3 * size_t(i)]);
+      material_ids[i] = geometry.material_ids[t];
+      primitives[i] = mesh_triangle(&geometry, i);
+    }
+    geometry.indices = std::move(indices);
+    geometry.material_ids = std::move(material_ids);
+  }
+
+  // loads a model from file into geometry and material_table: OBJ files with the native loader,
+  // everything else (or OBJ files it cannot read) with ASSIMP.
   void load_model(string const &path) {
+    if (obj_loader::handles(path)) {
+      using std::chrono::high_resolution_clock;
+      auto t1 = high_resolution_clock::now();
+      RTW_SPAN("obj parse");
+      if (obj_loader::load(path, geometry, material_table)) {
+        std::chrono::duration<double, std::milli> ms_double = high_resolution_clock::now() - t1;
+        std::clog << "OBJ parsing time: " << ms_double.count() << "ms" << std::endl;
+        return;
+      }
+      std::clog << "Falling back to ASSIMP for " << path << std::endl;
+    }
+    
+    RTW_SPAN("assimp import");
     Assimp::Importer import;
     import.SetPropertyInteger(AI_CONFIG_PP_SBP_REMOVE, aiPrimitiveType_LINE | aiPrimitiveType_POINT);
     const aiScene* scene = import.ReadFile(path,
@@ -62,14 +160,17 @@ private:
       std::clog << "ERROR::ASSIMP::" << import.GetErrorString() << std::endl;
       return;
     }
- 
-    directory = path.substr(0, path.find_last_of('/'));
     
-    // allocate the faces array
-    int primitives_count = calculate_number_of_faces(scene->mRootNode, scene);
-    primitives = new triangle[primitives_count];
+    // reserve the index buffers
+    int faces_count = calculate_number_of_faces(scene->mRootNode, scene);
+    geometry.indices.reserve(3 * size_t(faces_count));
+    geometry.material_ids.reserve(faces_count);
     
     process_node(scene->mRootNode, scene);
+    
+    // meshes without normals or texture coordinates get zeros, which hit() treats as missing
+    if (!geometry.normals.empty()) geometry.normals.resize(geometry.positions.size());
+    if (!geometry.uvs.empty()) geometry.uvs.resize(2 * geometry.positions.size());
   }
   
   int calculate_number_of_faces (const aiNode *node, const aiScene* scene) {
@@ -111,127 +212,93 @@ private:
     std::clog << "Mesh has: " << _mesh->mNumFaces << " faces; At most: " << _mesh->mNumFaces * 3 << " vertices;" << std::endl;
     std::clog << "Mesh has normals: " << std::boolalpha << _mesh->HasNormals() << std::endl;
  
-    int primitives_count_old = primitives_count;
+    // append the vertices, the faces keep indexing them (offset by the vertices already there)
+    const uint32_t base = uint32_t(geometry.positions.size());
     
-    // each face is a sigle triangle
-    // should have nNumFaces of trinagles in total
-    point3 vs[3];
-    point3 ns[3];
-    point2 uvs[3];
-
-    for (unsigned int i = 0; i < _mesh->mNumFaces; i++) {
-      const aiFace& face = _mesh->mFaces[i];
-      for (unsigned int j = 0; j < 3; j++) {
-        const int idx = face.mIndices[j];
-        vs[j][0] = _mesh->mVertices[idx].x;
-        vs[j][1] = _mesh->mVertices[idx].y;
-        vs[j][2] = _mesh->mVertices[idx].z;
- 
-        if (_mesh->HasNormals()) {
-          ns[j][0] = _mesh->mNormals[idx].x;
-          ns[j][1] = _mesh->mNormals[idx].y;
-          ns[j][2] = _mesh->mNormals[idx].z;
-        }
-              
-        if (_mesh->HasTextureCoords(0)) {  // Check if there are UV coordinates
-          uvs[j][0] = _mesh->mTextureCoords[0][idx].x;
-          uvs[j][1] = _mesh->mTextureCoords[0][idx].y;
-        }
+    for (unsigned int i = 0; i < _mesh->mNumVertices; i++) {
+      const aiVector3D& p = _mesh->mVertices[i];
+      geometry.positions.push_back(point3f(p.x, p.y, p.z));
+    }
+    
+    if (_mesh->HasNormals()) {
+      geometry.normals.resize(base);
+      for (unsigned int i = 0; i < _mesh->mNumVertices; i++) {
+        const aiVector3D& n = _mesh->mNormals[i];
+        geometry.normals.push_back(vec3f(n.x, n.y, n.z));
+      }
+    }
+    
+    if (_mesh->HasTextureCoords(0)) {  // Check if there are UV coordinates
+      geometry.uvs.resize(2 * size_t(base));
+      for (unsigned int i = 0; i < _mesh->mNumVertices; i++) {
+        geometry.uvs.push_back(_mesh->mTextureCoords[0][i].x);
+        geometry.uvs.push_back(_mesh->mTextureCoords[0][i].y);
       }
-      primitives[primitives_count].v1 = vs[0];
-      primitives[primitives_count].v2 = vs[1];
-      primitives[primitives_count].v3 = vs[2];
-      primitives[primitives_count].n1 = ns[0];
-      primitives[primitives_count].n2 = ns[1];
-      primitives[primitives_count].n3 = ns[2];
-      primitives[primitives_count].uv1 = uvs[0];
-      primitives[primitives_count].uv2 = uvs[1];
-      primitives[primitives_count].uv3 = uvs[2];
-      primitives[primitives_count].update_bounds();
-      primitives_count++;
     }
+    
     // process material
     aiMaterial* material = scene->mMaterials[_mesh->mMaterialIndex];
  
-    auto mat = loadMaterial(material);
+    auto mat = describe_material(material);
     
-    for (int primitive_idx = primitives_count_old; primitive_idx < primitives_count; primitive_idx++) {
-      primitives[primitive_idx].mat = mat;
+    // each face is a sigle triangle
+    for (unsigned int i = 0; i < _mesh->mNumFaces; i++) {
+      const aiFace& face = _mesh->mFaces[i];
+      for (unsigned int j = 0; j < 3; j++)
+        geometry.indices.push_back(base + face.mIndices[j]);
+      geometry.material_ids.push_back(mat);
     }
   }
  
-  shared_ptr<material> loadMaterial(aiMaterial *mat) {
+  uint32_t describe_material(aiMaterial *mat) {
+    // Returns the index of the material in material_table, adding it the first time it is seen.
     const auto mat_name = string{mat->GetName().C_Str()};
     
-    if (!materials_loaded.contains(mat_name)) {
-      std::clog << "Loading material " << mat_name << std::endl;
-      auto pbr_mat = make_shared<pbr>();
-      pbr_mat->albedo = loadTexture(mat, aiTextureType_DIFFUSE);
-      pbr_mat->emit = loadTexture(mat, aiTextureType_EMISSIVE);
-      materials_loaded[mat_name] = pbr_mat;
-    }
-    return materials_loaded[mat_name];
+    for (size_t i = 0; i < material_table.size(); i++)
+      if (material_table[i].name == mat_name) return uint32_t(i);
+    
+    material_desc desc;
+    desc.name = mat_name;
+    desc.diffuse = describe_texture(mat, aiTextureType_DIFFUSE);
+    desc.emissive = describe_texture(mat, aiTextureType_EMISSIVE);
+    material_table.push_back(desc);
+    return uint32_t(material_table.size() - 1);
   }
   
-  shared_ptr<texture> loadTexture(aiMaterial *mat, aiTextureType type) {
+  texture_desc describe_texture(aiMaterial *mat, aiTextureType type) {
     const aiString mat_name = mat->GetName();
+    texture_desc desc;
     
     if (mat->GetTextureCount(type) == 0) { // no texture, use color instead
       if (type == aiTextureType_DIFFUSE) {
         aiColor4D diffuse_color;
         if (AI_SUCCESS == aiGetMaterialColor(mat, AI_MATKEY_COLOR_DIFFUSE, &diffuse_color)) {
-          string key{"e_c"};
-          key.append(std::to_string(diffuse_color.r));
-          key.append(std::to_string(diffuse_color.g));
-          key.append(std::to_string(diffuse_color.b));
-          if (!textures_loaded.contains(key)) {
-            textures_loaded[key] = make_shared<solid_color>(diffuse_color.r, diffuse_color.g, diffuse_color.b);
-          }
-          return textures_loaded[key];
+          desc.source = texture_desc::solid;
+          desc.value = color(diffuse_color.r, diffuse_color.g, diffuse_color.b);
         } else {
           std::clog << "ERROR: Failed to fetch color for diffuse material " << mat_name.C_Str() << std::endl;
-          return default_diffuse;
         }
       }
       if (type == aiTextureType_EMISSIVE) {
         aiColor4D emission_color;
         if (AI_SUCCESS == aiGetMaterialColor(mat, AI_MATKEY_COLOR_EMISSIVE, &emission_color) && !emission_color.IsBlack()) {
-          string key{"e_c"};
-          key.append(std::to_string(emission_color.r));
-          key.append(std::to_string(emission_color.g));
-          key.append(std::to_string(emission_color.b));
-          if (!textures_loaded.contains(key)) {
-            textures_loaded[key] = make_shared<solid_color>(emission_color.r, emission_color.g, emission_color.b);
-          }
-          return textures_loaded[key];
+          desc.source = texture_desc::solid;
+          desc.value = color(emission_color.r, emission_color.g, emission_color.b);
         } else {
           std::clog << "ERROR: Failed to fetch color for emissive material " << mat_name.C_Str() << std::endl;
         }
-        return default_emissive;
       }
-      return nullptr;
+      return desc;
     }
 
     aiString str;
     if (AI_SUCCESS == mat->GetTexture(type, 0, &str)) {
-      std::string filename{str.C_Str()};
-      filename = directory + '/' + filename;
-      if (!textures_loaded.contains(filename)) {
-        std::clog << "Loading texture at: " << filename << std::endl;
-        textures_loaded[filename] = make_shared<image_texture>(filename.c_str());
-      }
-      return textures_loaded[filename];
+      desc.source = texture_desc::image;
+      desc.path = str.C_Str();
     } else {
       std::clog << "ERROR: Failed to fetch texture path for " << mat_name.C_Str() << std::endl;
-      switch(type) {
-        case aiTextureType_DIFFUSE:
-          return default_diffuse;
-        case aiTextureType_EMISSIVE:
-          return default_emissive;
-        default:
-          return nullptr;
-      }
     }
+    return desc;
 
 //    aiTextureType_AMBIENT - don't need
 //    aiTextureType_DIFFUSE - try texture, if no return checkers
@@ -241,6 +308,54 @@ private:
 //    aiTextureType_NORMALS - try texture, if no return null
 //    aiTextureType_METALNESS - try texture, if no return null
   }
+
+  void build_materials(material_numbering* numbering) {
+    // Creates the materials of material_table, in the same order, for the mesh to reference.
+    RTW_SPAN("materials", int64_t(material_table.size()));
+    auto& materials = geometry.materials;
+    materials.clear();
+    for (const auto& desc : material_table) {
+      if (!materials_loaded.contains(desc.name)) {
+        std::clog << "Loading material " << desc.name << std::endl;
+        auto pbr_mat = memory->make_shared<pbr>();
+        pbr_mat->albedo = load_texture(desc.diffuse, default_diffuse);
+        pbr_mat->emit = load_texture(desc.emissive, default_emissive);
+        materials_loaded[desc.name] = pbr_mat;
+      }
+      materials.push_back(materials_loaded[desc.name]);
+    }
+    if (materials.empty())
+      materials.push_back(default_mat);
+    material_numbering own;
+    for (auto& m : materials)
+      (numbering ? *numbering : own).add(*m);
+    for (auto& id : geometry.material_ids)
+      if (id >= materials.size()) id = 0;
+  }
+  
+  shared_ptr<texture> load_texture(const texture_desc& desc, shared_ptr<texture> fallback) {
+    if (desc.source == texture_desc::solid) {
+      string key{"e_c"};
+      key.append(std::to_string(float(desc.value.x())));
+      key.append(std::to_string(float(desc.value.y())));
+      key.append(std::to_string(float(desc.value.z())));
+      if (!textures_loaded.contains(key)) {
+        textures_loaded[key] = memory->make_shared<solid_color>(desc.value);
+      }
+      return textures_loaded[key];
+    }
+    
+    if (desc.source == texture_desc::image) {
+      std::string filename = directory + '/' + desc.path;
+      if (!textures_loaded.contains(filename)) {
+        std::clog << "Loading texture at: " << filename << std::endl;
+        // Only the header is read here; pixels are decoded on the first lookup.
+        textures_loaded[filename] = memory->make_shared<image_texture>(filename.c_str());
+      }
+      return textures_loaded[filename];
+    }
+    return fallback;
+  }
 };
 
 #endif
@@ -0,0 +1,417 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include "rtweekend.h"
+#include "color.h"
+#include "mesh.h"
+#include "mesh_cache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <future>
+#include <algorithm>
+
+// Native reader for Wavefront OBJ files and their MTL material libraries, used instead of
+// Assimp for .obj assets. The file is split into chunks at line boundaries which are parsed in
+// parallel; the chunks are then merged in order, turning every distinct (v, vt, vn) corner into
+// one vertex of an indexed mesh. Polygons are triangulated as fans.
+//
+// Only what the renderer uses is read: v, vt, vn, f, usemtl and mtllib from the OBJ, and
+// newmtl, Kd, Ke, map_Kd and map_Ke from the MTL. Materials default to a 0.6 grey diffuse
+// color, like Assimp's.
+
+class obj_loader {
+public:
+  static bool handles(const std::string& path) {
+    // True for .obj files, unless RTW_OBJ_LOADER=assimp asks for the generic importer.
+    auto env = getenv("RTW_OBJ_LOADER");
+    if (env != nullptr && std::string(env) == "assimp") return false;
+    auto dot = path.find_last_of('.');
+    if (dot == std::string::npos) return false;
+    auto extension = path.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension == "obj";
+  }
+
+  static bool load(const std::string& path, mesh& geometry, std::vector<material_desc>& materials) {
+    // Reads `path` into `geometry` (attributes, indices and material ids) and `materials`.
+    // Returns false, leaving both untouched, if the file could not be read or is malformed.
+    std::string text;
+    if (!read_file(path, text)) return false;
+
+    // Chunks of at least 256 KB, one per hardware thread
+    size_t chunk_count = std::max<size_t>(1, std::min<size_t>(
+      std::thread::hardware_concurrency(), text.size() / (256 << 10)));
+    std::vector<size_t> bounds{0};
+    for (size_t c = 1; c < chunk_count; c++) {
+      size_t split = std::max(bounds.back(), text.size() * c / chunk_count);
+      while (split < text.size() && text[split - 1] != '\n') split++;
+      bounds.push_back(split);
+    }
+    bounds.push_back(text.size());
+
+    std::vector<chunk> chunks(bounds.size() - 1);
+    std::vector<std::future<void>> jobs;
+    for (size_t c = 0; c < chunks.size(); c++) {
+      jobs.push_back(std::async(std::launch::async, [&, c] {
+        parse_chunk(text.data() + bounds[c], text.data() + bounds[c + 1], chunks[c]);
+      }));
+    }
+    for (auto& job : jobs) job.wait();
+
+    for (const auto& c : chunks) {
+      if (!c.error.empty()) {
+        std::clog << "ERROR: " << path << ": " << c.error << std::endl;
+        return false;
+      }
+    }
+
+    auto directory = path.substr(0, path.find_last_of('/') + 1);
+    std::vector<material_desc> library;
+    for (const auto& c : chunks)
+      for (const auto& name : c.libraries)
+        read_library(directory + name, library);
+
+    mesh result;
+    if (!merge(chunks, library, result)) {
+      std::clog << "ERROR: " << path << ": face refers to a missing vertex" << std::endl;
+      return false;
+    }
+    geometry.positions = std::move(result.positions);
+    geometry.normals = std::move(result.normals);
+    geometry.uvs = std::move(result.uvs);
+    geometry.indices = std::move(result.indices);
+    geometry.material_ids = std::move(result.material_ids);
+    materials = std::move(library);
+    return true;
+  }
+
+  static const char* parse_float(const char* p, const char* end, float& value) {
+    // Parses a decimal number. Numbers with at most 19 significant digits and a small exponent
+    // are computed exactly in double precision (Clinger's fast path) and rounded once to float;
+    // anything else goes through strtod. Returns nullptr if there is no number at p.
+    const char* start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any_digit = false, truncated = false;
+    for (bool fraction = false; p < end; p++) {
+      if (*p == '.' && !fraction) { fraction = true; continue; }
+      if (!is_digit(*p)) break;
+      any_digit = true;
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (*p - '0');
+        if (mantissa != 0) digits++;
+        if (fraction) exponent--;
+      } else {
+        truncated = truncated || *p != '0';
+        if (!fraction) exponent++;
+      }
+    }
+    if (!any_digit) return nullptr;
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+      const char* q = p + 1;
+      bool negative_exponent = false;
+      if (q < end && (*q == '-' || *q == '+')) negative_exponent = *q++ == '-';
+      if (q < end && is_digit(*q)) {
+        int e = 0;
+        for (; q < end && is_digit(*q); q++)
+          if (e < 10000) e = e * 10 + (*q - '0');
+        exponent += negative_exponent ? -e : e;
+        p = q;
+      }
+    }
+
+    static const double powers_of_ten[] = {
+      1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    if (truncated || mantissa > (uint64_t(1) << 53) || exponent < -22 || exponent > 22) {
+      char* parsed_end;
+      value = float(strtod(start, &parsed_end));
+      return parsed_end;
+    }
+    double result = double(mantissa);
+    result = exponent < 0 ? result / powers_of_ten[-exponent] : result * powers_of_ten[exponent];
+    value = float(negative ? -result : result);
+    return p;
+  }
+
+private:
+  static constexpr int64_t missing = -1;
+  static constexpr int64_t relative = int64_t(1) << 40; // bias of indices relative to the chunk
+
+  struct corner { int64_t v, vt, vn; };
+
+  struct chunk {
+    std::vector<float> positions; // three per v
+    std::vector<float> uvs;       // two per vt
+    std::vector<float> normals;   // three per vn
+    std::vector<corner> corners;  // three per triangle
+    std::vector<std::pair<size_t, std::string>> material_switches; // (first triangle, usemtl)
+    std::vector<std::string> libraries;
+    std::string error;
+  };
+
+  struct vertex_key {
+    int64_t v, vt, vn;
+    bool operator==(const vertex_key& o) const { return v == o.v && vt == o.vt && vn == o.vn; }
+  };
+
+  struct vertex_key_hash {
+    size_t operator()(const vertex_key& k) const {
+      return size_t(mix_bits(mix_bits(mix_bits(uint64_t(k.v)) ^ uint64_t(k.vt)) ^ uint64_t(k.vn)));
+    }
+  };
+
+  static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+  static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+  static const char* skip_spaces(const char* p, const char* end) {
+    while (p < end && is_space(*p)) p++;
+    return p;
+  }
+
+  static const char* skip_line(const char* p, const char* end) {
+    while (p < end && *p != '\n') p++;
+    return p < end ? p + 1 : end;
+  }
+
+  static std::string rest_of_line(const char* p, const char* end) {
+    p = skip_spaces(p, end);
+    const char* q = p;
+    while (q < end && *q != '\n') q++;
+    while (q > p && is_space(q[-1])) q--;
+    return std::string(p, q);
+  }
+
+  static bool keyword(const char*& p, const char* end, const char* word) {
+    // Consumes `word` at p if it is followed by a space.
+    size_t n = strlen(word);
+    if (size_t(end - p) <= n || strncmp(p, word, n) != 0 || !is_space(p[n])) return false;
+    p += n;
+    return true;
+  }
+
+  static const char* parse_index(const char* p, const char* end, int64_t count, int64_t& index) {
+    // Reads a 1-based OBJ index. Positive indices become 0-based global ones; negative ones
+    // count back from the `count` attributes this chunk has read so far, and are biased by
+    // `relative` until the merge knows the chunk's offset.
+    bool negative = p < end && *p == '-';
+    if (negative) p++;
+    if (p >= end || !is_digit(*p)) return nullptr;
+    int64_t value = 0;
+    for (; p < end && is_digit(*p); p++) value = value * 10 + (*p - '0');
+    if (value == 0) return nullptr;
+    index = negative ? relative + count - value : value - 1;
+    return p;
+  }
+
+  static const char* parse_floats(const char* p, const char* end, int n, std::vector<float>& out) {
+    for (int i = 0; i < n; i++) {
+      float value;
+      p = skip_spaces(p, end);
+      if ((p = parse_float(p, end, value)) == nullptr) return nullptr;
+      out.push_back(value);
+    }
+    return p;
+  }
+
+  static void parse_chunk(const char* p, const char* end, chunk& c) {
+    std::vector<corner> polygon;
+    while (p < end) {
+      p = skip_spaces(p, end);
+      const char* line = p;
+      if (keyword(p, end, "v")) {
+        p = parse_floats(p, end, 3, c.positions);
+      } else if (keyword(p, end, "vt")) {
+        p = parse_floats(p, end, 2, c.uvs);
+      } else if (keyword(p, end, "vn")) {
+        p = parse_floats(p, end, 3, c.normals);
+      } else if (keyword(p, end, "f")) {
+        int64_t v_count = c.positions.size() / 3;
+        int64_t vt_count = c.uvs.size() / 2;
+        int64_t vn_count = c.normals.size() / 3;
+        polygon.clear();
+        while (p != nullptr && (p = skip_spaces(p, end)) < end && *p != '\n') {
+          corner k{missing, missing, missing};
+          p = parse_index(p, end, v_count, k.v);
+          if (p != nullptr && p < end && *p == '/') {
+            if (++p < end && *p != '/' && !is_space(*p) && *p != '\n')
+              p = parse_index(p, end, vt_count, k.vt);
+            if (p != nullptr && p < end && *p == '/')
+              p = parse_index(p + 1, end, vn_count, k.vn);
+          }
+          if (p != nullptr) polygon.push_back(k);
+        }
+        if (p != nullptr && polygon.size() < 3) p = nullptr;
+        for (size_t i = 2; p != nullptr && i < polygon.size(); i++) {
+          c.corners.push_back(polygon[0]);
+          c.corners.push_back(polygon[i - 1]);
+          c.corners.push_back(polygon[i]);
+        }
+      } else if (keyword(p, end, "usemtl")) {
+        c.material_switches.emplace_back(c.corners.size() / 3, rest_of_line(p, end));
+      } else if (keyword(p, end, "mtllib")) {
+        c.libraries.push_back(rest_of_line(p, end));
+      }
+      if (p == nullptr) {
+        c.error = "cannot parse '" + rest_of_line(line, end) + "'";
+        return;
+      }
+      p = skip_line(p, end);
+    }
+  }
+
+  static bool merge(const std::vector<chunk>& chunks, std::vector<material_desc>& library, mesh& result) {
+    // Concatenates the chunks' attributes and builds one vertex per distinct corner.
+    std::vector<float> positions, uvs, normals;
+    size_t triangle_count = 0;
+    for (const auto& c : chunks) {
+      positions.insert(positions.end(), c.positions.begin(), c.positions.end());
+      uvs.insert(uvs.end(), c.uvs.begin(), c.uvs.end());
+      normals.insert(normals.end(), c.normals.begin(), c.normals.end());
+      triangle_count += c.corners.size() / 3;
+    }
+    const int64_t v_total = positions.size() / 3;
+    const int64_t vt_total = uvs.size() / 2;
+    const int64_t vn_total = normals.size() / 3;
+
+    std::unordered_map<std::string, uint32_t> material_ids;
+    for (size_t i = 0; i < library.size(); i++) material_ids.emplace(library[i].name, uint32_t(i));
+    auto material_id = [&](const std::string& name) {
+      auto found = material_ids.find(name);
+      if (found != material_ids.end()) return found->second;
+      library.push_back(default_material(name));
+      return material_ids[name] = uint32_t(library.size() - 1);
+    };
+    uint32_t current_material = UINT32_MAX; // faces before any usemtl get the default material
+
+    std::unordered_map<vertex_key, uint32_t, vertex_key_hash> vertices;
+    vertices.reserve(v_total);
+    std::vector<vertex_key> keys;
+    bool has_uvs = false, has_normals = false;
+    result.indices.reserve(3 * triangle_count);
+    result.material_ids.reserve(triangle_count);
+
+    int64_t v_offset = 0, vt_offset = 0, vn_offset = 0;
+    for (const auto& c : chunks) {
+      auto resolve = [](int64_t index, int64_t offset) {
+        return index >= relative / 2 ? offset + index - relative : index;
+      };
+      size_t next_switch = 0;
+      for (size_t t = 0; ; t++) {
+        // usemtl lines after the last face of the chunk carry over to the next one
+        for (; next_switch < c.material_switches.size() && c.material_switches[next_switch].first == t; next_switch++)
+          current_material = material_id(c.material_switches[next_switch].second);
+        if (t == c.corners.size() / 3) break;
+        if (current_material == UINT32_MAX) current_material = material_id("DefaultMaterial");
+
+        for (int j = 0; j < 3; j++) {
+          const corner& k = c.corners[3 * t + j];
+          vertex_key key{resolve(k.v, v_offset), missing, missing};
+          if (key.v < 0 || key.v >= v_total) return false;
+          if (k.vt != missing) key.vt = resolve(k.vt, vt_offset);
+          if (k.vn != missing) key.vn = resolve(k.vn, vn_offset);
+          if (key.vt < 0 || key.vt >= vt_total) key.vt = missing;
+          if (key.vn < 0 || key.vn >= vn_total) key.vn = missing;
+          has_uvs = has_uvs || key.vt != missing;
+          has_normals = has_normals || key.vn != missing;
+
+          auto inserted = vertices.emplace(key, uint32_t(keys.size()));
+          if (inserted.second) keys.push_back(key);
+          result.indices.push_back(inserted.first->second);
+        }
+        result.material_ids.push_back(current_material);
+      }
+      v_offset += c.positions.size() / 3;
+      vt_offset += c.uvs.size() / 2;
+      vn_offset += c.normals.size() / 3;
+    }
+
+    result.positions.resize(keys.size());
+    if (has_normals) result.normals.resize(keys.size());
+    if (has_uvs) result.uvs.resize(2 * keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+      const vertex_key& key = keys[i];
+      result.positions[i] = point3f(positions[3*key.v], positions[3*key.v + 1], positions[3*key.v + 2]);
+      if (has_normals && key.vn != missing)
+        result.normals[i] = vec3f(normals[3*key.vn], normals[3*key.vn + 1], normals[3*key.vn + 2]);
+      if (has_uvs && key.vt != missing) {
+        result.uvs[2*i] = uvs[2*key.vt];
+        result.uvs[2*i + 1] = uvs[2*key.vt + 1];
+      }
+    }
+    return true;
+  }
+
+  static material_desc default_material(const std::string& name) {
+    material_desc desc;
+    desc.name = name;
+    desc.diffuse.source = texture_desc::solid;
+    desc.diffuse.value = color(0.6, 0.6, 0.6);
+    return desc;
+  }
+
+  static void read_library(const std::string& path, std::vector<material_desc>& library) {
+    std::string text;
+    if (!read_file(path, text)) {
+      std::clog << "ERROR: Could not read material library " << path << std::endl;
+      return;
+    }
+    const char* p = text.data();
+    const char* end = p + text.size();
+    material_desc* current = nullptr;
+    auto read_color = [&](texture_desc& desc, bool skip_black) {
+      std::vector<float> rgb;
+      if (parse_floats(p, end, 3, rgb) == nullptr) return;
+      if (skip_black && rgb[0] == 0 && rgb[1] == 0 && rgb[2] == 0) return;
+      // A texture map wins over a color, whichever comes first
+      if (desc.source == texture_desc::image) return;
+      desc.source = texture_desc::solid;
+      desc.value = color(rgb[0], rgb[1], rgb[2]);
+    };
+    auto read_map = [&](texture_desc& desc) {
+      // Options like "-bm 1.0" come before the file name, which is taken to be the last word
+      auto line = rest_of_line(p, end);
+      auto name = line.substr(line.find_last_of(" \t") == std::string::npos ? 0 : line.find_last_of(" \t") + 1);
+      if (name.empty()) return;
+      desc.source = texture_desc::image;
+      desc.path = name;
+    };
+
+    while (p < end) {
+      p = skip_spaces(p, end);
+      if (keyword(p, end, "newmtl")) {
+        library.push_back(default_material(rest_of_line(p, end)));
+        current = &library.back();
+      } else if (current != nullptr) {
+        if (keyword(p, end, "Kd")) read_color(current->diffuse, false);
+        else if (keyword(p, end, "Ke")) read_color(current->emissive, true);
+        else if (keyword(p, end, "map_Kd")) read_map(current->diffuse);
+        else if (keyword(p, end, "map_Ke")) read_map(current->emissive);
+      }
+      p = skip_line(p, end);
+    }
+  }
+
+  static bool read_file(const std::string& path, std::string& text) {
+    FILE* in = fopen(path.c_str(), "rb");
+    if (in == nullptr) return false;
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    text.resize(size > 0 ? size : 0);
+    bool read = size >= 0 && fread(text.data(), 1, text.size(), in) == text.size();
+    fclose(in);
+    return read;
+  }
+};
+
+#endif
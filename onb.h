@@ -0,0 +1,30 @@
+#ifndef ONB_H
+#define ONB_H
+
+#include "rtweekend.h"
+
+#include <cassert>
+
+class onb {
+  // Orthonormal basis around a unit vector w, used to bring directions sampled around +z into
+  // world space. Branchless construction from Duff et al., "Building an Orthonormal Basis,
+  // Revisited" (2017), which only holds for a unit w: shading normals are unit length at their
+  // source (primitives and bvh_instance), so it is not normalized again here.
+public:
+  vec3 u, v, w;
+
+  onb(const vec3& n) : w{n} {
+    assert(fabs(dot(n, n) - 1) < 1e-3);
+    auto sign = std::copysign(1.0, w.z());
+    auto a = -1.0 / (sign + w.z());
+    auto b = w.x() * w.y() * a;
+    u = vec3(1.0 + sign * w.x() * w.x() * a, sign * b, -sign * w.x());
+    v = vec3(b, sign + w.y() * w.y() * a, -w.y());
+  }
+
+  vec3 local(double a, double b, double c) const { return a*u + b*v + c*w; }
+
+  vec3 local(const vec3& a) const { return a.x()*u + a.y()*v + a.z()*w; }
+};
+
+#endif
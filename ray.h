@@ -9,15 +9,29 @@ public:
 
 	ray(const point3& origin, const vec3& direction) : orig{origin}, dir{direction} {};
 
+	ray(const point3& origin, const vec3& direction, double width, double spread)
+		: orig{origin}, dir{direction}, cone_width{width}, cone_spread{spread} {};
+
 	point3 origin() const { return orig;  }
 	point3 direction() const { return dir; }
 
 	point3 at(double t) const {
 		return orig + t*dir;
 	}
+
+	// Ray cone, used to estimate texture footprints: width at the origin and spread angle.
+	double width() const { return cone_width; }
+	double spread() const { return cone_spread; }
+
+	double width_at(double t) const {
+		// Cone width at parameter t (the direction does not need to be normalized).
+		return cone_width + cone_spread * t * sqrt(dot(dir, dir));
+	}
 private:
 	point3 orig;
 	point3 dir;
+	double cone_width = 0;
+	double cone_spread = 0;
 };
 
 #endif
\ No newline at end of file
@@ -10,8 +10,12 @@
 #define STBI_FAILURE_USERMSG
 #include "stb_image.h"
 
+#include "trace.h"
+
 #include <cstdlib>
 #include <iostream>
+#include <string>
+#include <vector>
 
 class rtw_image {
 public:
@@ -24,11 +28,14 @@ public:
     data{other.data},
     image_width{other.image_width},
     image_height{other.image_height},
-    bytes_per_scanline{other.bytes_per_scanline}
+    bytes_per_scanline{other.bytes_per_scanline},
+    tiled{other.tiled},
+    tiles_per_row{other.tiles_per_row}
     {
     other.data = nullptr;
     other.image_width = other.image_height = 0;
     other.bytes_per_scanline = 0;
+    other.tiles_per_row = 0;
   }
 
   rtw_image& operator=(rtw_image&& other) noexcept {
@@ -36,42 +43,98 @@ public:
     std::swap(image_width, other.image_width);
     std::swap(image_height, other.image_height);
     std::swap(bytes_per_scanline, other.bytes_per_scanline);
+    std::swap(tiled, other.tiled);
+    std::swap(tiles_per_row, other.tiles_per_row);
     return *this;
   }
   
-  rtw_image(const char* image_filename) {
-    // Loads image data from the specified file. If the RTW_IMAGES environment variable is
-    // defined, looks only in that directory for the image file. If the image was not found,
-    // searches for the specified image file first from the current directory, then in the
-    // images/ subdirectory, then the _parent's_ images/ subdirectory, and then _that_
-    // parent, on so on, for six levels up. If the image was not loaded successfully,
-    // width() and height() will return 0.
+  rtw_image(const char* image_filename, bool _tiled = true) : data(nullptr), tiled{_tiled} {
+    // Loads image data from the specified file, trying the locations of candidate_paths() in
+    // order. If the image was not loaded successfully, width() and height() will return 0.
+    //
+    // With `_tiled` set, pixels are stored as RGBA8 in 4x4 tiles (one 64 byte cache line per
+    // tile) instead of RGB8 scanlines, so filtering footprints spanning rows stay in one line.
+    
+    for (const auto& path : candidate_paths(image_filename))
+      if (load(path)) return;
     
+    std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
+  }
+  
+  static std::vector<std::string> candidate_paths(const char* image_filename) {
+    // If the RTW_IMAGES environment variable is defined, looks first in that directory for the
+    // image file. Then searches for the specified image file from the current directory, then
+    // in the images/ subdirectory, then the _parent's_ images/ subdirectory, and then _that_
+    // parent, on so on, for six levels up.
     auto filename = std::string(image_filename);
     auto imagedir = getenv("RTW_IMAGES");
     
-    // Hunt for the image file in some likely locations.
-    if (imagedir && load(std::string(imagedir) + "/" + image_filename)) return;
-    if (load(filename)) return;
-    if (load("images/" + filename)) return;
-    if (load("../images/" + filename)) return;
-    if (load("../../images/" + filename)) return;
-    if (load("../../../images/" + filename)) return;
-    if (load("../../../../images/" + filename)) return;
-    if (load("../../../../../images/" + filename)) return;
-    if (load("../../../../../../images/" + filename)) return;
-    
-    std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
+    std::vector<std::string> paths;
+    if (imagedir) paths.push_back(std::string(imagedir) + "/" + image_filename);
+    paths.push_back(filename);
+    std::string prefix = "images/";
+    for (int i = 0; i < 7; i++, prefix = "../" + prefix)
+      paths.push_back(prefix + filename);
+    return paths;
+  }
+  
+  static bool info(const char* image_filename, std::string& path, int& width, int& height) {
+    // Finds the image file like the constructor does and reads its size without decoding it.
+    int n;
+    for (const auto& candidate : candidate_paths(image_filename)) {
+      if (stbi_info(candidate.c_str(), &width, &height, &n)) {
+        path = candidate;
+        return true;
+      }
+    }
+    return false;
   }
   
-  ~rtw_image() { STBI_FREE(data); }
+  ~rtw_image() { release(); }
   
   bool load(const std::string filename) {
     // Loads image data from the given file name. Returns true if the load succeeded.
+    RTW_SPAN("texture decode");
     auto n = BYTES_PER_PIXEL; // Dummy out parameter: original components per pixel
-    data = stbi_load(filename.c_str(), &image_width, &image_height, &n, BYTES_PER_PIXEL);
+    auto rgb = stbi_load(filename.c_str(), &image_width, &image_height, &n, BYTES_PER_PIXEL);
     bytes_per_scanline = image_width * BYTES_PER_PIXEL;
-    return data != nullptr;
+    if (rgb == nullptr || !tiled) {
+      data = rgb;
+      return data != nullptr;
+    }
+    
+    // Swizzle once into the tiled layout.
+    allocate(image_width, image_height);
+    for (int y = 0; y < image_height; y++) {
+      for (int x = 0; x < image_width; x++) {
+        const unsigned char* in = rgb + y*bytes_per_scanline + x*BYTES_PER_PIXEL;
+        unsigned char* out = data + tiled_offset(x, y);
+        out[0] = in[0], out[1] = in[1], out[2] = in[2], out[3] = 255;
+      }
+    }
+    STBI_FREE(rgb);
+    return true;
+  }
+  
+  rtw_image downsample() const {
+    // Returns the next mip level: half the resolution (rounded down, at least one pixel),
+    // every pixel the box filtered average of the 2x2 pixels above it.
+    rtw_image level;
+    level.tiled = tiled;
+    level.allocate(image_width > 1 ? image_width / 2 : 1, image_height > 1 ? image_height / 2 : 1);
+
+    for (int y = 0; y < level.image_height; y++) {
+      for (int x = 0; x < level.image_width; x++) {
+        const unsigned char* p[4] = {
+          pixel_data(2*x, 2*y), pixel_data(2*x + 1, 2*y),
+          pixel_data(2*x, 2*y + 1), pixel_data(2*x + 1, 2*y + 1)
+        };
+        unsigned char* out = const_cast<unsigned char*>(level.pixel_data(x, y));
+        for (int c = 0; c < BYTES_PER_PIXEL; c++)
+          out[c] = static_cast<unsigned char>((p[0][c] + p[1][c] + p[2][c] + p[3][c] + 2) / 4);
+      }
+    }
+    return level;
   }
   
   int width()   const { return (data == nullptr) ? 0 : image_width; }
@@ -79,21 +142,71 @@ public:
   
   const unsigned char* pixel_data(int x, int y) const {
     // Return the address of the three bytes of the pixel at x,y (or magenta if no data).
+    // Tiled images pad every pixel with a fourth (alpha) byte.
     static unsigned char magenta[] = { 255, 0, 255 };
     if (data == nullptr) return magenta;
 
     x = clamp(x, 0, image_width);
     y = clamp(y, 0, image_height);
 
+    if (tiled) return data + tiled_offset(x, y);
     return data + y*bytes_per_scanline + x*BYTES_PER_PIXEL;
   }
   
+  bool is_tiled() const { return tiled; }
+  
+  size_t size_in_bytes() const {
+    if (data == nullptr) return 0;
+    if (tiled)
+      return size_t(tiles_per_row) * ((image_height + TILE_SIZE - 1) / TILE_SIZE)
+        * TILE_SIZE * TILE_SIZE * TILED_BYTES_PER_PIXEL;
+    return size_t(bytes_per_scanline) * image_height;
+  }
+  
 private:
   static constexpr int BYTES_PER_PIXEL = 3;
+  static constexpr int TILED_BYTES_PER_PIXEL = 4;
+  static constexpr int TILE_SIZE = 4; // 4x4 RGBA8 pixels, 64 bytes
  
   unsigned char *data;
   int image_width, image_height;
   int bytes_per_scanline;
+  bool tiled = false;
+  int tiles_per_row = 0;
+  
+  size_t tiled_offset(int x, int y) const {
+    size_t tile = (y / TILE_SIZE) * tiles_per_row + (x / TILE_SIZE);
+    size_t in_tile = (y % TILE_SIZE) * TILE_SIZE + (x % TILE_SIZE);
+    return (tile * TILE_SIZE * TILE_SIZE + in_tile) * TILED_BYTES_PER_PIXEL;
+  }
+  
+  void allocate(int width, int height) {
+    // Allocates uninitialized pixels for the current layout.
+    image_width = width;
+    image_height = height;
+    bytes_per_scanline = width * BYTES_PER_PIXEL;
+    if (!tiled) {
+      data = (unsigned char*) STBI_MALLOC(bytes_per_scanline * height);
+      return;
+    }
+    tiles_per_row = (width + TILE_SIZE - 1) / TILE_SIZE;
+    int tile_rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+    size_t bytes = size_t(tiles_per_row) * tile_rows * TILE_SIZE * TILE_SIZE * TILED_BYTES_PER_PIXEL;
+#if _MSC_VER >= 1900
+    data = (unsigned char*) _aligned_malloc(bytes, 64);
+#else
+    data = (unsigned char*) std::aligned_alloc(64, bytes);
+#endif
+  }
+  
+  void release() {
+    if (data == nullptr) return;
+#if _MSC_VER >= 1900
+    if (tiled) { _aligned_free(data); data = nullptr; return; }
+#endif
+    STBI_FREE(data);
+    data = nullptr;
+  }
   
   static int clamp(int x, int low, int high) {
     // Return the value clamped to the range [low, high).
@@ -4,7 +4,7 @@
 #include <cmath>
 #include <limits>
 #include <memory>
-#include <random>
+#include <cstdint>
 #include <thread>
 #include <vector>
 #include <future>
@@ -31,23 +31,56 @@ inline double degrees_to_radians(double degrees) {
 	return degrees * pi / 180.0;
 }
 
-static std::hash<std::thread::id> hasher;
-static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-static std::exponential_distribution<double> exp_distribution(1);
+// Random numbers
+
+inline uint64_t mix_bits(uint64_t v) {
+  // 64-bit finalizer, pbrt-v4's MixBits (its own shifts and multipliers, not those of splitmix64
+  // or MurmurHash3 fmix64); scatters every input bit over the output.
+  v ^= v >> 31;
+  v *= 0x7fb5d329728ea185ULL;
+  v ^= v >> 27;
+  v *= 0x81dadef4bc2dd44dULL;
+  v ^= v >> 33;
+  return v;
+}
 
-inline double random_double() {
-  static thread_local std::mt19937 generator(
-    static_cast<unsigned>(hasher(std::this_thread::get_id()))
-  );
-  return distribution(generator);
+class rng {
+  // Counter-based generator: the n-th value of a stream is a hash of the stream key and n, so
+  // the whole state is 16 bytes and any stream can be recreated from (pixel, sample) alone,
+  // independently of which thread ends up rendering it.
+public:
+  rng() = default;
+  rng(uint64_t a, uint64_t b = 0) : key{mix_bits(a ^ mix_bits(b + 0x9e3779b97f4a7c15ULL))} {}
+
+  uint64_t next_uint64() {
+    return mix_bits(key + (++counter) * 0x9e3779b97f4a7c15ULL);
+  }
+
+  double next_double() {
+    // Returns a random real in [0,1) built from the top 53 bits.
+    return (next_uint64() >> 11) * 0x1p-53;
+  }
+
+private:
+  uint64_t key = 0;
+  uint64_t counter = 0;
+};
+
+static thread_local rng random_generator;
+
+inline void seed_random(uint64_t a, uint64_t b = 0) {
+  // Restarts the calling thread's random stream, e.g. per (pixel, sample).
+  random_generator = rng(a, b);
 }
 
+inline double random_double() {
+  // Returns a random real in [0,1).
+  return random_generator.next_double();
+}
 
 inline double random_double_exp() {
-  static thread_local std::mt19937 generator(
-    static_cast<unsigned>(hasher(std::this_thread::get_id()) * 10)
-  );
-  return exp_distribution(generator);
+  // Returns an exponentially distributed real with rate 1.
+  return -std::log(1.0 - random_double());
 }
 
 inline double random_double(double min, double max) {
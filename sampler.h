@@ -0,0 +1,222 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+
+// Samplers hand out the random numbers of one camera path. Every call to get_1d / get_2d
+// consumes the next sample dimension, so the camera and materials have to ask for their
+// dimensions in a fixed order (pixel position first, then one or more per bounce).
+
+enum class sampler_type {
+  independent, // uniform random numbers, the reference
+  sobol,       // Owen-scrambled Sobol, per pixel shuffled sequence
+  zsobol       // Owen-scrambled Sobol over Morton ordered pixels, blue noise error distribution
+};
+
+class sampler {
+public:
+  virtual ~sampler() = default;
+
+  virtual void start_pixel_sample(int x, int y, int sample_index) {
+    pixel_x = x;
+    pixel_y = y;
+    index = sample_index;
+    dimension = 0;
+  }
+
+  virtual double get_1d() = 0;
+  virtual vec2 get_2d() = 0;
+
+protected:
+  int pixel_x = 0, pixel_y = 0;
+  int index = 0;
+  int dimension = 0;
+};
+
+// Sobol and Owen scrambling helpers, after Burley, "Practical Hash-based Owen Scrambling" (2020).
+
+inline uint32_t reverse_bits(uint32_t x) {
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+  x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+  x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+  x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+  return x;
+}
+
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+  // Owen scrambling: a random flip of every bit that depends on all the bits above it.
+  x = reverse_bits(x);
+  x = laine_karras_permutation(x, seed);
+  return reverse_bits(x);
+}
+
+inline uint32_t sobol_sample(uint64_t index, int dim) {
+  // First two Sobol dimensions, at 32 bit precision for 64 bit indices like pbrt's. Dimension 0
+  // is van der Corput, whose index bits past 32 fall below the precision; dimension 1 uses the
+  // direction numbers of the primitive polynomial x + 1 (v_k = v_k-1 ^ v_k-1 >> 1), which stay
+  // nonzero past 32.
+  if (dim == 0)
+    return reverse_bits(uint32_t(index));
+  uint32_t result = 0;
+  for (uint32_t v = 0x80000000u; index; index >>= 1, v ^= v >> 1)
+    if (index & 1) result ^= v;
+  return result;
+}
+
+inline double to_unit_double(uint32_t x) {
+  return x * 0x1p-32;
+}
+
+class independent_sampler : public sampler {
+public:
+  independent_sampler(uint64_t _seed) : seed{_seed} {}
+
+  void start_pixel_sample(int x, int y, int sample_index) override {
+    sampler::start_pixel_sample(x, y, sample_index);
+    generator = rng(mix_bits(seed ^ (uint64_t(y) << 32 | uint32_t(x))), sample_index);
+  }
+
+  double get_1d() override { return generator.next_double(); }
+  vec2 get_2d() override { return vec2{generator.next_double(), generator.next_double()}; }
+
+private:
+  uint64_t seed;
+  rng generator;
+};
+
+class sobol_sampler : public sampler {
+  // Every pixel and every pair of dimensions walks a differently shuffled and scrambled
+  // 2D Sobol sequence, which keeps dimensions decorrelated without higher Sobol dimensions.
+public:
+  sobol_sampler(uint64_t _seed) : seed{_seed} {}
+
+  double get_1d() override {
+    uint32_t hash = dimension_hash();
+    dimension++;
+    uint32_t i = nested_uniform_scramble(index, hash);
+    return to_unit_double(nested_uniform_scramble(sobol_sample(i, 0), hash ^ 0xa511e9b3u));
+  }
+
+  vec2 get_2d() override {
+    uint32_t hash = dimension_hash();
+    dimension += 2;
+    uint32_t i = nested_uniform_scramble(index, hash);
+    return vec2{
+      to_unit_double(nested_uniform_scramble(sobol_sample(i, 0), hash ^ 0xa511e9b3u)),
+      to_unit_double(nested_uniform_scramble(sobol_sample(i, 1), hash ^ 0x63d83595u))
+    };
+  }
+
+private:
+  uint64_t seed;
+
+  uint32_t dimension_hash() const {
+    uint64_t pixel = uint64_t(pixel_y) << 32 | uint32_t(pixel_x);
+    return uint32_t(mix_bits(mix_bits(pixel ^ seed) + dimension) >> 32);
+  }
+};
+
+class zsobol_sampler : public sampler {
+  // Ahmed and Wonka, "Screen-Space Blue-Noise Diffusion of Monte Carlo Sampling Error via
+  // Hierarchical Ordering of Pixels" (2020). One global Owen-scrambled Sobol sequence is split
+  // over the pixels in Morton order, with randomly permuted base-4 digits, so neighbouring
+  // pixels receive well stratified samples and the error becomes blue noise.
+public:
+  zsobol_sampler(int samples_per_pixel, int width, int height, uint64_t _seed) : seed{_seed} {
+    while ((1 << log2_spp) < samples_per_pixel) log2_spp++;
+    int log2_res = 0;
+    while ((1 << log2_res) < std::max(width, height)) log2_res++;
+    base4_digits = log2_res + (log2_spp + 1) / 2;
+  }
+
+  void start_pixel_sample(int x, int y, int sample_index) override {
+    sampler::start_pixel_sample(x, y, sample_index);
+    morton_index = (encode_morton2(x, y) << log2_spp) | uint64_t(sample_index);
+  }
+
+  double get_1d() override {
+    // The index takes 2 log2(resolution) + log2(spp) bits, more than 32 for large renders
+    uint64_t i = sample_index();
+    uint32_t hash = uint32_t(mix_bits(seed + dimension));
+    dimension++;
+    return to_unit_double(nested_uniform_scramble(sobol_sample(i, 0), hash));
+  }
+
+  vec2 get_2d() override {
+    uint64_t i = sample_index();
+    uint64_t hash = mix_bits(seed + dimension);
+    dimension += 2;
+    return vec2{
+      to_unit_double(nested_uniform_scramble(sobol_sample(i, 0), uint32_t(hash))),
+      to_unit_double(nested_uniform_scramble(sobol_sample(i, 1), uint32_t(hash >> 32)))
+    };
+  }
+
+private:
+  uint64_t seed;
+  int log2_spp = 0;
+  int base4_digits = 0;
+  uint64_t morton_index = 0;
+
+  static uint64_t encode_morton2(uint32_t x, uint32_t y) {
+    auto spread = [](uint64_t v) {
+      v = (v | (v << 16)) & 0x0000ffff0000ffffULL;
+      v = (v | (v << 8)) & 0x00ff00ff00ff00ffULL;
+      v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+      v = (v | (v << 2)) & 0x3333333333333333ULL;
+      v = (v | (v << 1)) & 0x5555555555555555ULL;
+      return v;
+    };
+    return (spread(y) << 1) | spread(x);
+  }
+
+  uint64_t sample_index() const {
+    // Randomly permute every base-4 digit of the Morton index, the permutation depending on
+    // the digits above it and on the dimension.
+    static const uint8_t permutations[24][4] = {
+      {0, 1, 2, 3}, {0, 1, 3, 2}, {0, 2, 1, 3}, {0, 2, 3, 1}, {0, 3, 2, 1}, {0, 3, 1, 2},
+      {1, 0, 2, 3}, {1, 0, 3, 2}, {1, 2, 0, 3}, {1, 2, 3, 0}, {1, 3, 2, 0}, {1, 3, 0, 2},
+      {2, 1, 0, 3}, {2, 1, 3, 0}, {2, 0, 1, 3}, {2, 0, 3, 1}, {2, 3, 0, 1}, {2, 3, 1, 0},
+      {3, 1, 2, 0}, {3, 1, 0, 2}, {3, 2, 1, 0}, {3, 2, 0, 1}, {3, 0, 2, 1}, {3, 0, 1, 2}
+    };
+    uint64_t result = 0;
+    bool odd_log2_spp = log2_spp & 1;
+    int last_digit = odd_log2_spp ? 1 : 0;
+    for (int i = base4_digits - 1; i >= last_digit; i--) {
+      int digit_shift = 2 * i - (odd_log2_spp ? 1 : 0);
+      int digit = (morton_index >> digit_shift) & 3;
+      uint64_t higher_digits = morton_index >> (digit_shift + 2);
+      int p = (mix_bits(higher_digits ^ (0x55555555u * uint64_t(dimension))) >> 24) % 24;
+      result |= uint64_t(permutations[p][digit]) << digit_shift;
+    }
+    if (odd_log2_spp) {
+      int digit = morton_index & 1;
+      result |= digit ^ (mix_bits((morton_index >> 1) ^ (0x55555555u * uint64_t(dimension))) & 1);
+    }
+    return result;
+  }
+};
+
+inline std::unique_ptr<sampler> make_sampler(
+  sampler_type type, int samples_per_pixel, int width, int height, uint64_t seed)
+{
+  switch (type) {
+    case sampler_type::independent: return std::make_unique<independent_sampler>(seed);
+    case sampler_type::zsobol:      return std::make_unique<zsobol_sampler>(samples_per_pixel, width, height, seed);
+    default:                        return std::make_unique<sobol_sampler>(seed);
+  }
+}
+
+#endif
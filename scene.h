@@ -0,0 +1,693 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "rtweekend.h"
+
+#include "arena.h"
+#include "camera.h"
+#include "color.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "texture.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "model.h"
+#include "bvh.h"
+#include "tlas.h"
+
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Everything needed to render an image: the camera, the objects and the memory they live in.
+// A scene is filled either from code or from a text description (see load()). Spheres end up in
+// one BVH and model instances in one TLAS, built by build() once everything has been added.
+//
+// Scene files are read line by line; `#` starts a comment. Each line is a statement:
+//
+//   image_width 1280                       camera settings, named like the camera members:
+//   aspect_ratio 16 9                      aspect_ratio (one number, or width and height),
+//   lookfrom 13 2 3                        image_width, samples_per_pixel, max_depth,
+//   ...                                    background, vfov, lookfrom, lookat, vup,
+//                                          defocus_angle, focus_dist, seed, heatmap
+//                                          (none, nodes, primitives or time), heatmap_max,
+//                                          exr_pixels (half or float), aovs (any of albedo,
+//                                          normal, depth, material and instance, or none)
+//   output image.png                       default output file, the command line wins; .png
+//                                          is 8 bit, .pfm and .exr hold linear floats
+//
+//   frame <path> [<camera setting>...]     render a frame to <path> with the camera as set
+//                                          so far, changed by the settings given
+//   turntable <count> <path>               `count` frames circling the camera around lookat,
+//                                          with {} in <path> replaced by the frame number
+//   include <path>                         read another scene file, e.g. a scene to add
+//                                          frames to
+//
+//   texture <name> solid <r g b>
+//   texture <name> checker <scale> <color> <color>
+//   texture <name> image <path>
+//
+//   material <name> lambertian <color>
+//   material <name> metal <color> [fuzz <number>]
+//   material <name> dielectric <number>
+//   material <name> light <color> [intensity <number>]
+//   material <name> pbr <color> [emit <color>] [intensity <number>]
+//
+//   sphere <material> <x y z> <radius>
+//   triangle <material> <x y z> <x y z> <x y z>
+//   model <name> <path> [compressed]       compressed: quantized BVH nodes, for very large meshes
+//   model_material <model> <material> intensity <number>
+//   instance <model> [translate <x y z>] [rotate_x|rotate_y|rotate_z <degrees>] [scale <s | x y z>]...
+//
+//   sphere_field <placement> [avoid <x y z> <radius>] radius <number> materials <material> <weight>...
+//   instance_field <placement> [avoid <x y z> <radius>] [rotate_y <number> | turn <from> <to> |
+//                  face <x y z>] models <model> <weight> <scale>...
+//
+// A <color> is three numbers, the name of a texture, `random` (the product of two random colors)
+// or `random <min> <max>`. A <number> is a number or `random <min> <max>`. Materials using random
+// values are drawn again for every object that uses them. Transforms apply right to left, like
+// the matrix product they are written as. Fields place one object at each point of
+//
+//   grid <origin x y z> <u x y z> <v x y z> <nu> <nv> [jitter <fraction>]
+//   box <min x y z> <max x y z> <count>
+//   disk <center x y z> <inner radius> <outer radius> <count>      (in the xz plane)
+//
+// picking its material or model at random by weight. Paths are relative to the scene file.
+
+class scene {
+public:
+  arena memory;  // first, so it is released after everything allocated from it
+  hittable_list world;
+  camera cam;
+  std::string out_path;  // empty to write a PPM to standard output
+
+  // Batch rendering: when frames are given, render() renders each of them instead of `cam`,
+  // all against the same built world.
+  struct frame {
+    camera cam;
+    std::string out_path;
+  };
+  std::vector<frame> frames;
+  int frames_in_flight = 2;  // frames rendered at once, so one frame's tail overlaps the next
+
+  // What build() made of the spheres and instances, for tools that look at them directly
+  sphere* sphere_list = nullptr;  // in BVH leaf order, not the order they were added in
+  int sphere_count = 0;
+  shared_ptr<bvh<sphere>> sphere_bvh;
+  bvh_instance<mesh_triangle>* instance_list = nullptr;
+  int instance_count = 0;
+  shared_ptr<tlas<mesh_triangle>> instance_tlas;  // unless there is a single instance
+
+  std::map<std::string, model*> models;  // by name
+
+  // Numbers the scene's materials for the material ID output. Materials made here and in its
+  // models are added as they are made; others have to be added by whoever makes them.
+  material_numbering material_numbers;
+
+  scene() { cam.out_path = nullptr; }
+
+  scene(const scene&) = delete;
+  scene& operator=(const scene&) = delete;
+
+  model& add_model(const std::string& name, const std::string& path, unsigned blas_flags = 0) {
+    model* m = memory.create<model>(path.c_str(), &memory, blas_flags, &material_numbers);
+    models[name] = m;
+    return *m;
+  }
+
+  void add_sphere(const point3& center, double radius, shared_ptr<material> mat) {
+    if (mat) material_numbers.add(*mat);
+    spheres.push_back(sphere{center, radius, mat});
+  }
+
+  void add_instance(model& m, const mat4& transform) {
+    instances.push_back(bvh_instance<mesh_triangle>(&m.blas));
+    instances.back().set_transform(transform);
+  }
+
+  void add(shared_ptr<hittable> object) { world.add(object); }
+
+  void build() {
+    // Builds the sphere BVH and the instance TLAS and adds them to the world. Objects added
+    // after this are not picked up.
+    if (built) return;
+    built = true;
+    RTW_SPAN("scene build");
+
+    if (!spheres.empty()) {
+      sphere_count = int(spheres.size());
+      sphere_list = memory.create_array<sphere>(sphere_count);
+      std::copy(spheres.begin(), spheres.end(), sphere_list);
+      sphere_bvh = memory.make_shared<bvh<sphere>>(sphere_list, sphere_count, &memory, BVH_REORDER_PRIMITIVES);
+      world.add(sphere_bvh);
+      std::clog << "Rendering " << sphere_count << " spheres" << std::endl;
+    }
+
+    instance_count = int(instances.size());
+    for (int i = 0; i < instance_count; i++) instances[i].set_index(i);
+    if (instance_count == 1) {
+      auto instance = memory.make_shared<bvh_instance<mesh_triangle>>(instances[0]);
+      instance_list = instance.get();
+      world.add(instance);
+    } else if (instance_count > 1) {
+      instance_list = memory.create_array<bvh_instance<mesh_triangle>>(instance_count);
+      std::copy(instances.begin(), instances.end(), instance_list);
+      instance_tlas = memory.make_shared<tlas<mesh_triangle>>(instance_list, instance_count, &memory);
+      instance_tlas->build();
+      world.add(instance_tlas);
+    }
+    spheres.clear();
+    instances.clear();
+  }
+
+  void render() {
+    build();
+    if (frames.empty()) {
+      cam.out_path = out_path.empty() ? nullptr : out_path.c_str();
+      cam.render(world);
+      return;
+    }
+
+    // A frame's last samples leave most threads idle; starting the next frame fills them.
+    // Render statistics are counted per frame, so they need frames one at a time.
+    int limit = std::max(1, frames_in_flight);
+    RTW_STAT(limit = 1);
+    std::deque<std::future<void>> in_flight;
+    for (size_t i = 0; i < frames.size(); i++) {
+      if (int(in_flight.size()) >= limit) {
+        RTW_SPAN("wait for frame");
+        in_flight.front().get();
+        in_flight.pop_front();
+      }
+      frame& f = frames[i];
+      f.cam.out_path = f.out_path.c_str();
+      std::clog << "Frame " << i + 1 << "/" << frames.size() << ": " << f.out_path << std::endl;
+      in_flight.push_back(std::async(std::launch::async, [&f, this] { f.cam.render(world); }));
+    }
+    for (auto& f : in_flight) f.get();
+  }
+
+  bool load(const std::string& path) {
+    // Adds the contents of the scene file at `path`. On error, reports the offending line and
+    // returns false; the scene is then incomplete and should not be rendered.
+    RTW_SPAN("load scene");
+    std::ifstream in(path);
+    if (!in) {
+      std::clog << "ERROR: Could not read scene file " << path << std::endl;
+      return false;
+    }
+    auto slash = path.find_last_of('/');
+    directory = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+
+    std::string line;
+    for (int line_number = 1; std::getline(in, line); line_number++) {
+      statement s{line.substr(0, line.find('#'))};
+      if (!s.done()) parse(s);
+      if (!s.error.empty()) {
+        std::clog << "ERROR: " << path << ":" << line_number << ": " << s.error << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  std::vector<sphere> spheres;
+  std::vector<bvh_instance<mesh_triangle>> instances;
+  bool built = false;
+
+  // Names given in the scene file
+  std::string directory;
+  std::map<std::string, shared_ptr<texture>> textures;
+
+  struct statement {
+    // The words of one line, consumed from the front.
+    std::vector<std::string> words;
+    size_t next = 0;
+    std::string error;
+
+    statement(const std::string& line) {
+      std::istringstream stream(line);
+      for (std::string word; stream >> word;) words.push_back(word);
+    }
+
+    bool done() const { return next >= words.size() || !error.empty(); }
+    void fail(const std::string& message) { if (error.empty()) error = message; }
+
+    bool accept(const char* keyword) {
+      if (done() || words[next] != keyword) return false;
+      next++;
+      return true;
+    }
+
+    bool is_number(size_t ahead = 0) const {
+      if (next + ahead >= words.size()) return false;
+      const char* w = words[next + ahead].c_str();
+      char* end;
+      strtod(w, &end);
+      return end != w && *end == '\0';
+    }
+
+    std::string word(const char* what) {
+      if (done()) {
+        fail(std::string("expected ") + what);
+        return "";
+      }
+      return words[next++];
+    }
+
+    double number(const char* what) {
+      if (!is_number()) {
+        fail(std::string("expected ") + what);
+        return 0;
+      }
+      return strtod(words[next++].c_str(), nullptr);
+    }
+
+    vec3 triple(const char* what) {
+      auto x = number(what);
+      auto y = number(what);
+      auto z = number(what);
+      return vec3(x, y, z);
+    }
+  };
+
+  struct number_spec {
+    double min = 0, max = 0;
+    bool random() const { return min != max; }
+    double sample() const { return random() ? random_double(min, max) : min; }
+  };
+
+  struct color_spec {
+    enum { fixed, random_product, random_range } kind = fixed;
+    color value;
+    double min = 0, max = 1;
+    shared_ptr<texture> map;  // instead of a fixed value
+
+    bool random() const { return kind != fixed; }
+    color sample() const {
+      if (kind == random_product) return color::random() * color::random();
+      if (kind == random_range) return color::random(min, max);
+      return value;
+    }
+  };
+
+  struct material_recipe {
+    std::string type;
+    color_spec albedo, emit;
+    number_spec fuzz, ior, intensity;
+    bool emits = false, bright = false;  // emit and intensity given
+    shared_ptr<material> shared;  // made once if nothing is random
+  };
+
+  std::map<std::string, material_recipe> recipes;
+
+  number_spec read_number(statement& s, const char* what) {
+    number_spec n;
+    if (s.accept("random")) {
+      n.min = s.number(what);
+      n.max = s.number(what);
+    } else {
+      n.min = n.max = s.number(what);
+    }
+    return n;
+  }
+
+  color_spec read_color(statement& s) {
+    color_spec c;
+    if (s.accept("random")) {
+      c.kind = color_spec::random_product;
+      if (s.is_number() && s.is_number(1)) {
+        c.kind = color_spec::random_range;
+        c.min = s.number("minimum");
+        c.max = s.number("maximum");
+      }
+    } else if (!s.done() && !s.is_number()) {
+      auto name = s.word("texture");
+      if (!textures.contains(name)) s.fail("unknown texture " + name);
+      c.map = textures[name];
+    } else {
+      c.value = s.triple("color");
+    }
+    return c;
+  }
+
+  shared_ptr<texture> texture_for(const color_spec& c) {
+    return c.map ? c.map : memory.make_shared<solid_color>(c.sample());
+  }
+
+  shared_ptr<material> material_for(material_recipe& r) {
+    if (r.shared) return r.shared;
+
+    shared_ptr<material> result;
+    if (r.type == "lambertian") {
+      result = memory.make_shared<lambertian>(texture_for(r.albedo));
+    } else if (r.type == "metal") {
+      result = memory.make_shared<metal>(r.albedo.sample(), r.fuzz.sample());
+    } else if (r.type == "dielectric") {
+      result = memory.make_shared<dielectric>(r.ior.sample());
+    } else if (r.type == "light") {
+      auto light = memory.make_shared<diffuse_light>(texture_for(r.albedo));
+      if (r.bright) light->emission_intensity = r.intensity.sample();
+      result = light;
+    } else {
+      auto p = memory.make_shared<pbr>();
+      p->albedo = texture_for(r.albedo);
+      p->emit = r.emits ? texture_for(r.emit) : p->albedo;
+      if (r.bright) p->emission_intensity = r.intensity.sample();
+      result = p;
+    }
+
+    if (!r.albedo.random() && !r.emit.random() && !r.fuzz.random() && !r.ior.random() && !r.intensity.random())
+      r.shared = result;
+    material_numbers.add(*result);
+    return result;
+  }
+
+  material_recipe* find_material(statement& s) {
+    auto name = s.word("material");
+    if (!recipes.contains(name)) {
+      s.fail("unknown material " + name);
+      return nullptr;
+    }
+    return &recipes[name];
+  }
+
+  model* find_model(statement& s) {
+    auto name = s.word("model");
+    if (!models.contains(name)) {
+      s.fail("unknown model " + name);
+      return nullptr;
+    }
+    return models[name];
+  }
+
+  std::string resolve(const std::string& path) const {
+    return path.starts_with('/') ? path : directory + path;
+  }
+
+  bool parse_camera(const std::string& keyword, statement& s, camera& c) {
+    // Camera settings, which frames can also change. False if `keyword` is not one.
+    if (keyword == "aspect_ratio") {
+      c.aspect_ratio = s.number("aspect ratio");
+      if (s.is_number()) c.aspect_ratio /= s.number("height");
+    }
+    else if (keyword == "image_width") c.image_width = int(s.number("width"));
+    else if (keyword == "samples_per_pixel") c.samples_per_pixel = int(s.number("sample count"));
+    else if (keyword == "max_depth") c.max_depth = int(s.number("depth"));
+    else if (keyword == "background") c.background = s.triple("color");
+    else if (keyword == "vfov") c.vfov = s.number("angle");
+    else if (keyword == "lookfrom") c.lookfrom = s.triple("point");
+    else if (keyword == "lookat") c.lookat = s.triple("point");
+    else if (keyword == "vup") c.vup = s.triple("direction");
+    else if (keyword == "defocus_angle") c.defocus_angle = s.number("angle");
+    else if (keyword == "focus_dist") c.focus_dist = s.number("distance");
+    else if (keyword == "seed") c.seed = uint64_t(s.number("seed"));
+    else if (keyword == "heatmap") {
+      auto type = s.word("heatmap type");
+      if (type == "none") c.heatmap = heatmap_type::none;
+      else if (type == "nodes") c.heatmap = heatmap_type::nodes;
+      else if (type == "primitives") c.heatmap = heatmap_type::primitives;
+      else if (type == "time") c.heatmap = heatmap_type::time;
+      else s.fail("unknown heatmap " + type);
+    }
+    else if (keyword == "heatmap_max") c.heatmap_max = s.number("cost");
+    else if (keyword == "exr_pixels") {
+      auto type = s.word("pixel type");
+      if (type == "half" || type == "float") c.exr_half = type == "half";
+      else s.fail("unknown pixel type " + type);
+    }
+    else if (keyword == "aovs") {
+      // Takes the AOV names that follow, so a frame can list more settings after them
+      c.aovs = 0;
+      while (true) {
+        if (s.accept("albedo")) c.aovs |= AOV_ALBEDO;
+        else if (s.accept("normal")) c.aovs |= AOV_NORMAL;
+        else if (s.accept("depth")) c.aovs |= AOV_DEPTH;
+        else if (s.accept("material")) c.aovs |= AOV_MATERIAL_ID;
+        else if (s.accept("instance")) c.aovs |= AOV_INSTANCE_ID;
+        else if (!s.accept("none")) break;
+      }
+    }
+    else return false;
+    return true;
+  }
+
+  void parse(statement& s) {
+    auto keyword = s.word("statement");
+
+    if (parse_camera(keyword, s, cam)) {}
+    else if (keyword == "output") out_path = s.word("path");
+    else if (keyword == "include") {
+      auto path = resolve(s.word("path"));
+      auto outer = directory;
+      if (s.error.empty() && !load(path)) s.fail("could not include " + path);
+      directory = outer;
+    }
+    else if (keyword == "frame") {
+      frame f{cam, s.word("path")};
+      while (!s.done()) {
+        auto setting = s.word("camera setting");
+        if (!parse_camera(setting, s, f.cam)) s.fail("unknown camera setting " + setting);
+      }
+      frames.push_back(f);
+    }
+    else if (keyword == "turntable") parse_turntable(s);
+    else if (keyword == "texture") parse_texture(s);
+    else if (keyword == "material") parse_material(s);
+    else if (keyword == "sphere") {
+      auto recipe = find_material(s);
+      auto center = s.triple("center");
+      auto radius = read_number(s, "radius");
+      if (recipe) add_sphere(center, radius.sample(), material_for(*recipe));
+    }
+    else if (keyword == "triangle") {
+      auto recipe = find_material(s);
+      point3 v1 = s.triple("vertex"), v2 = s.triple("vertex"), v3 = s.triple("vertex");
+      if (recipe == nullptr || !s.error.empty()) return;
+      auto n = unit_vector(cross(v2 - v1, v3 - v1));
+      auto tri = memory.make_shared<triangle>(v1, v2, v3, n, n, n, vec2{0, 0}, vec2{0, 1}, vec2{1, 0});
+      tri->mat = material_for(*recipe);
+      world.add(tri);
+    }
+    else if (keyword == "model") {
+      auto name = s.word("name");
+      auto path = resolve(s.word("path"));
+      unsigned flags = s.accept("compressed") ? unsigned(BVH_COMPRESS) : 0u;
+      if (s.error.empty() && add_model(name, path, flags).primitives_count == 0) s.fail("could not load " + path);
+    }
+    else if (keyword == "model_material") {
+      auto m = find_model(s);
+      auto name = s.word("material");
+      if (m == nullptr || !s.accept("intensity")) {
+        s.fail("expected model, material and intensity");
+        return;
+      }
+      auto intensity = s.number("intensity");
+      auto mat = m->materials_loaded.find(name);
+      auto p = mat == m->materials_loaded.end() ? nullptr : std::dynamic_pointer_cast<pbr>(mat->second);
+      if (p) p->emission_intensity = intensity;
+      else s.fail("model has no material " + name);
+    }
+    else if (keyword == "instance") {
+      auto m = find_model(s);
+      auto transform = read_transform(s);
+      if (m) add_instance(*m, transform);
+    }
+    else if (keyword == "sphere_field" || keyword == "instance_field") parse_field(s, keyword == "sphere_field");
+    else s.fail("unknown statement " + keyword);
+
+    if (s.error.empty() && !s.done()) s.fail("unexpected " + s.words[s.next]);
+  }
+
+  void parse_turntable(statement& s) {
+    // `count` frames with the camera circling around lookat, about the vup axis. The frame
+    // number replaces {} in the path.
+    int count = int(s.number("frame count"));
+    auto pattern = s.word("path");
+    auto braces = pattern.find("{}");
+    if (braces == std::string::npos) s.fail("the path needs {} for the frame number");
+    if (!s.error.empty()) return;
+
+    auto axis = unit_vector(cam.vup);
+    auto offset = cam.lookfrom - cam.lookat;
+    for (int k = 0; k < count; k++) {
+      // Rodrigues' rotation of the offset
+      auto theta = 2 * pi * k / count;
+      auto rotated = cos(theta) * offset + sin(theta) * cross(axis, offset)
+        + (1 - cos(theta)) * dot(axis, offset) * axis;
+
+      char number[16];
+      snprintf(number, sizeof(number), "%04d", k);
+      frame f{cam, pattern.substr(0, braces) + number + pattern.substr(braces + 2)};
+      f.cam.lookfrom = cam.lookat + rotated;
+      frames.push_back(f);
+    }
+  }
+
+  void parse_texture(statement& s) {
+    auto name = s.word("texture name");
+    auto type = s.word("texture type");
+    if (type == "solid") {
+      textures[name] = memory.make_shared<solid_color>(s.triple("color"));
+    } else if (type == "checker") {
+      auto scale = s.number("scale");
+      auto even = texture_for(read_color(s));
+      auto odd = texture_for(read_color(s));
+      textures[name] = memory.make_shared<checker_texture>(scale, even, odd);
+    } else if (type == "image") {
+      auto path = resolve(s.word("path"));
+      textures[name] = memory.make_shared<image_texture>(path.c_str());
+    } else {
+      s.fail("unknown texture type " + type);
+    }
+  }
+
+  void parse_material(statement& s) {
+    auto name = s.word("material name");
+    material_recipe r;
+    r.type = s.word("material type");
+    if (r.type == "dielectric") {
+      r.ior = read_number(s, "index of refraction");
+    } else if (r.type == "lambertian" || r.type == "metal" || r.type == "light" || r.type == "pbr") {
+      r.albedo = read_color(s);
+      if (r.type == "metal" && r.albedo.map) s.fail("metal takes a color, not a texture");
+      while (!s.done()) {
+        if (r.type == "metal" && s.accept("fuzz")) r.fuzz = read_number(s, "fuzz");
+        else if (r.type == "pbr" && s.accept("emit")) {
+          r.emit = read_color(s);
+          r.emits = true;
+        }
+        else if ((r.type == "light" || r.type == "pbr") && s.accept("intensity")) {
+          r.intensity = read_number(s, "intensity");
+          r.bright = true;
+        }
+        else break;
+      }
+    } else {
+      s.fail("unknown material type " + r.type);
+    }
+    recipes[name] = r;
+  }
+
+  mat4 read_transform(statement& s) {
+    mat4 transform;
+    while (!s.done()) {
+      if (s.accept("translate")) transform = transform * mat4::Translate(vec3f(s.triple("offset")));
+      else if (s.accept("rotate_x")) transform = transform * mat4::RotateX(degrees_to_radians(s.number("angle")));
+      else if (s.accept("rotate_y")) transform = transform * mat4::RotateY(degrees_to_radians(s.number("angle")));
+      else if (s.accept("rotate_z")) transform = transform * mat4::RotateZ(degrees_to_radians(s.number("angle")));
+      else if (s.accept("scale")) {
+        if (s.is_number(1)) transform = transform * mat4::Scale(vec3f(s.triple("scale")));
+        else transform = transform * mat4::Scale(float(s.number("scale")));
+      }
+      else break;
+    }
+    return transform;
+  }
+
+  void parse_field(statement& s, bool of_spheres) {
+    // Placement
+    std::vector<point3> points;
+    if (s.accept("grid")) {
+      auto origin = s.triple("origin");
+      auto u = s.triple("u step"), v = s.triple("v step");
+      int nu = int(s.number("u count")), nv = int(s.number("v count"));
+      double jitter = s.accept("jitter") ? s.number("jitter") : 0;
+      for (int j = 0; j < nv; j++)
+        for (int i = 0; i < nu; i++) {
+          auto du = jitter * random_double();
+          auto dv = jitter * random_double();
+          points.push_back(origin + (i + du) * u + (j + dv) * v);
+        }
+    } else if (s.accept("box")) {
+      auto bmin = s.triple("corner"), bmax = s.triple("corner");
+      int count = int(s.number("count"));
+      for (int i = 0; i < count; i++)
+        points.push_back(bmin + vec3::random() * (bmax - bmin));
+    } else if (s.accept("disk")) {
+      auto center = s.triple("center");
+      auto inner = s.number("inner radius"), outer = s.number("outer radius");
+      int count = int(s.number("count"));
+      for (int i = 0; i < count; i++) {
+        // uniform over the area of the ring
+        auto r = sqrt(random_double(inner * inner, outer * outer));
+        auto phi = 2 * pi * random_double();
+        points.push_back(center + vec3(r * cos(phi), 0, r * sin(phi)));
+      }
+    } else {
+      s.fail("expected grid, box or disk");
+      return;
+    }
+
+    // Options, then what to place
+    point3 avoid_center;
+    double avoid_radius = 0;
+    number_spec radius, rotation;
+    double turn_from = 0, turn_to = 0;
+    bool turn = false, face = false;
+    point3 face_target;
+    while (!s.done()) {
+      if (s.accept("avoid")) {
+        avoid_center = s.triple("center");
+        avoid_radius = s.number("radius");
+      }
+      else if (of_spheres && s.accept("radius")) radius = read_number(s, "radius");
+      else if (!of_spheres && s.accept("rotate_y")) rotation = read_number(s, "angle");
+      else if (!of_spheres && s.accept("turn")) {
+        turn = true;
+        turn_from = s.number("angle");
+        turn_to = s.number("angle");
+      }
+      else if (!of_spheres && s.accept("face")) {
+        face = true;
+        face_target = s.triple("point");
+      }
+      else break;
+    }
+
+    struct choice { double weight; material_recipe* recipe; model* m; double scale; };
+    std::vector<choice> choices;
+    double total_weight = 0;
+    if (!s.accept(of_spheres ? "materials" : "models")) s.fail(of_spheres ? "expected materials" : "expected models");
+    while (!s.done()) {
+      choice c{};
+      if (of_spheres) c.recipe = find_material(s);
+      else c.m = find_model(s);
+      c.weight = s.number("weight");
+      if (!of_spheres) c.scale = s.number("scale");
+      total_weight += c.weight;
+      choices.push_back(c);
+    }
+    if (!s.error.empty()) return;
+    if (choices.empty() || total_weight <= 0) {
+      s.fail("nothing to place");
+      return;
+    }
+
+    for (size_t i = 0; i < points.size(); i++) {
+      auto& p = points[i];
+      if ((p - avoid_center).length() < avoid_radius) continue;
+
+      auto pick = random_double(0, total_weight);
+      size_t k = 0;
+      while (k + 1 < choices.size() && pick >= choices[k].weight) pick -= choices[k++].weight;
+      auto& c = choices[k];
+
+      if (of_spheres) {
+        add_sphere(p, radius.sample(), material_for(*c.recipe));
+      } else {
+        double angle = degrees_to_radians(rotation.sample());
+        if (turn) angle = degrees_to_radians(turn_from + (turn_to - turn_from) * i / points.size());
+        if (face) angle = atan2(face_target.x() - p.x(), face_target.z() - p.z());
+        add_instance(*c.m, mat4::Translate(vec3f(p)) * mat4::RotateY(angle) * mat4::Scale(float(c.scale)));
+      }
+    }
+  }
+};
+
+#endif
@@ -42,6 +42,10 @@ public:
 		rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
 		rec.mat = mat;
+    
+    // dp/du = 2 pi r sin(theta), dp/dv = pi r
+    auto sin_theta = fmax(sqrt(fmax(0.0, 1 - outward_normal.y() * outward_normal.y())), 1e-3);
+    rec.set_uv_footprint(r, 1.0 / (pi * radius * sqrt(2 * sin_theta)));
 
 		return true;
 	}
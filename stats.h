@@ -0,0 +1,185 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Render counters, compiled in when RTW_STATS is defined and free otherwise. Every thread counts
+// into a block of its own, so counting needs no synchronization; collect() sums the blocks once
+// the threads that wrote them have been joined (e.g. after camera::render returns).
+//
+// With RTW_STATS, camera::render prints the counts of each image to std::clog, and appends them
+// as one line of JSON to the file named by the RTW_STATS_JSON environment variable.
+//
+//   RTW_STAT(stats::local().rays[bounce]++);
+
+#ifdef RTW_STATS
+#define RTW_STAT(...) __VA_ARGS__
+#else
+#define RTW_STAT(...)
+#endif
+
+struct render_stats {
+  static constexpr int max_bounces = 64;
+
+  uint64_t rays[max_bounces] = {};  // rays traced, by bounce (0 for camera rays)
+  uint64_t paths_escaped = 0;       // paths that left the scene
+  uint64_t paths_absorbed = 0;      // paths ended by a material that does not scatter
+  uint64_t paths_cut = 0;           // paths ended by max_depth
+  uint64_t bvh_nodes_visited = 0;
+  uint64_t box_tests = 0;           // in BVHs and TLASes
+  uint64_t primitive_tests = 0;
+  uint64_t tlas_nodes_visited = 0;
+  uint64_t tlas_leaf_visits = 0;
+  uint64_t instance_transforms = 0;
+  double bvh_build_ms = 0;          // time spent building BVHs and TLASes
+
+  uint64_t total_rays() const {
+    uint64_t total = 0;
+    for (auto r : rays) total += r;
+    return total;
+  }
+
+  int bounces() const {
+    // Number of bounces that traced any ray.
+    int n = max_bounces;
+    while (n > 0 && rays[n - 1] == 0) n--;
+    return n;
+  }
+
+  render_stats& operator+=(const render_stats& other) { return combine(other, 1); }
+  render_stats& operator-=(const render_stats& other) { return combine(other, -1); }
+
+  void print(std::ostream& out) const {
+    // Summary table, with every traversal count also given per ray traced.
+    auto total = total_rays();
+    auto per_ray = [&](uint64_t n) { return total > 0 ? double(n) / total : 0.0; };
+    char line[128];
+    auto row = [&](const char* name, uint64_t n, bool average) {
+      if (average) snprintf(line, sizeof(line), "  %-20s %15llu %10.2f per ray\n", name, (unsigned long long)n, per_ray(n));
+      else snprintf(line, sizeof(line), "  %-20s %15llu\n", name, (unsigned long long)n);
+      out << line;
+    };
+    out << "Render statistics\n";
+    row("rays", total, false);
+    for (int b = 0; b < bounces(); b++) {
+      snprintf(line, sizeof(line), "    bounce %-11d %15llu\n", b, (unsigned long long)rays[b]);
+      out << line;
+    }
+    row("paths escaped", paths_escaped, false);
+    row("paths absorbed", paths_absorbed, false);
+    row("paths cut at depth", paths_cut, false);
+    row("BVH nodes visited", bvh_nodes_visited, true);
+    row("box tests", box_tests, true);
+    row("primitive tests", primitive_tests, true);
+    row("TLAS nodes visited", tlas_nodes_visited, true);
+    row("TLAS leaf visits", tlas_leaf_visits, true);
+    row("instance transforms", instance_transforms, true);
+    out << std::flush;
+  }
+
+  std::string json() const {
+    // One JSON object with every counter.
+    std::string result = "{\"rays\": " + std::to_string(total_rays()) + ", \"rays_per_bounce\": [";
+    for (int b = 0; b < bounces(); b++) result += (b == 0 ? "" : ", ") + std::to_string(rays[b]);
+    result += "]";
+    auto field = [&](const char* name, uint64_t n) { result += std::string(", \"") + name + "\": " + std::to_string(n); };
+    field("paths_escaped", paths_escaped);
+    field("paths_absorbed", paths_absorbed);
+    field("paths_cut", paths_cut);
+    field("bvh_nodes_visited", bvh_nodes_visited);
+    field("box_tests", box_tests);
+    field("primitive_tests", primitive_tests);
+    field("tlas_nodes_visited", tlas_nodes_visited);
+    field("tlas_leaf_visits", tlas_leaf_visits);
+    field("instance_transforms", instance_transforms);
+    char build[64];
+    snprintf(build, sizeof(build), ", \"bvh_build_ms\": %.3f}", bvh_build_ms);
+    return result + build;
+  }
+
+private:
+  render_stats& combine(const render_stats& other, int sign) {
+    // Counts wrap around on subtraction, which is right as long as the result is a difference
+    // of a later and an earlier total.
+    auto add = [sign](uint64_t& a, uint64_t b) { a = sign > 0 ? a + b : a - b; };
+    for (int i = 0; i < max_bounces; i++) add(rays[i], other.rays[i]);
+    add(paths_escaped, other.paths_escaped);
+    add(paths_absorbed, other.paths_absorbed);
+    add(paths_cut, other.paths_cut);
+    add(bvh_nodes_visited, other.bvh_nodes_visited);
+    add(box_tests, other.box_tests);
+    add(primitive_tests, other.primitive_tests);
+    add(tlas_nodes_visited, other.tlas_nodes_visited);
+    add(tlas_leaf_visits, other.tlas_leaf_visits);
+    add(instance_transforms, other.instance_transforms);
+    bvh_build_ms += sign * other.bvh_build_ms;
+    return *this;
+  }
+};
+
+class stats {
+public:
+  static render_stats& local() {
+    thread_local slot s;
+    return *s.counters;
+  }
+
+  static render_stats collect() {
+    render_stats total;
+    std::lock_guard<std::mutex> lock(registry().mutex);
+    for (auto& block : registry().blocks) total += *block;
+    total += registry().retired;
+    return total;
+  }
+
+  static void reset() {
+    std::lock_guard<std::mutex> lock(registry().mutex);
+    for (auto& block : registry().blocks) *block = render_stats{};
+    registry().retired = render_stats{};
+  }
+
+private:
+  struct blocks {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<render_stats>> blocks;  // all blocks, in use or free
+    std::vector<render_stats*> free;
+    render_stats retired;  // counts of blocks handed back by threads that exited
+  };
+
+  static blocks& registry() {
+    static blocks r;
+    return r;
+  }
+
+  struct slot {
+    // Takes a block when the thread first counts, hands it back when the thread exits. The
+    // renderer starts threads per frame, so blocks are recycled rather than piling up.
+    render_stats* counters;
+
+    slot() {
+      std::lock_guard<std::mutex> lock(registry().mutex);
+      auto& r = registry();
+      if (r.free.empty()) {
+        r.blocks.push_back(std::make_unique<render_stats>());
+        r.free.push_back(r.blocks.back().get());
+      }
+      counters = r.free.back();
+      r.free.pop_back();
+    }
+
+    ~slot() {
+      std::lock_guard<std::mutex> lock(registry().mutex);
+      registry().retired += *counters;
+      *counters = render_stats{};
+      registry().free.push_back(counters);
+    }
+  };
+};
+
+#endif
@@ -2,13 +2,18 @@
 #define TEXTURE_H
 
 #include "rtweekend.h"
-#include "rtw_stb_image.h"
+#include "texture_cache.h"
 
 class texture {
 public:
   virtual ~texture() = default;
   
   virtual color value(double u, double v, const point3& p) const = 0;
+  
+  virtual color filtered_value(double u, double v, double footprint, const point3& p) const {
+    // Texture value averaged over a footprint of the given width in texture space.
+    return value(u, v, p);
+  }
 };
 
 class solid_color : public texture {
@@ -45,6 +50,16 @@ public:
     
     return isEven ? even->value(u, v, p) : odd->value(u, v, p);
   }
+  
+  color filtered_value(double u, double v, double footprint, const point3& p) const override {
+    auto xInteger = static_cast<int>(std::floor(inv_scale * p.x()));
+    auto yInteger = static_cast<int>(std::floor(inv_scale * p.y()));
+    auto zInteger = static_cast<int>(std::floor(inv_scale * p.z()));
+    
+    bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
+    
+    return isEven ? even->filtered_value(u, v, footprint, p) : odd->filtered_value(u, v, footprint, p);
+  }
 private:
   double inv_scale;
   shared_ptr<texture> even;
@@ -55,35 +70,61 @@ class image_texture : public texture {
   public:
     std::string path;
 
-    image_texture(const char* filename) : image(filename) {
+    image_texture(const char* filename) : image{texture_cache::global().open(filename)} {
       path = filename;
     }
  
     image_texture(const image_texture&) = delete;
     image_texture& operator=(const image_texture&) = delete;
- 
-    image_texture(image_texture&& other) noexcept : image(std::move(other.image)) {}
-    image_texture& operator=(image_texture&& other) noexcept {
-      std::swap(image, other.image);
-    }
     
     color value(double u, double v, const point3& p) const override {
+      return filtered_value(u, v, 0, p);
+    }
+    
+    color filtered_value(double u, double v, double footprint, const point3& p) const override {
       // If we have no texture data, then return solid cyan as a debugging aid.
-      if (image.height() <= 0) return color(0,1,1);
+      if (!image->valid()) return color(0,1,1);
       
       // Camp input texture coordinates to [0,1] x [1,0]
       u = interval(0,1).clamp(u);
       v = 1.0 - interval(0,1).clamp(v); // Flip V to image coordinates
       
-      auto i = static_cast<int>(u * image.width());
-      auto j = static_cast<int>(v * image.height());
-      auto pixel = image.pixel_data(i,j);
+      // Trilinear filtering: pick the two levels whose texels are closest to the footprint size
+      // and blend between their bilinear lookups. Levels are loaded by the texture cache on
+      // first use, so never touched levels are never decoded.
+      auto texels = footprint * std::max(image->width, image->height);
+      auto lod = interval(0, image->level_count - 1).clamp(texels > 1 ? std::log2(texels) : 0);
+      auto level = static_cast<int>(lod);
+      auto t = lod - level;
       
-      auto color_scale = 1.0 / 255.0;
-      return color(color_scale*pixel[0], color_scale*pixel[1], color_scale*pixel[2]);
+      texture_cache::read_guard guard;
+      auto c = bilinear(image->level(level), u, v);
+      if (t > 0)
+        c = (1 - t) * c + t * bilinear(image->level(level + 1), u, v);
+      return c;
     }
   private:
-    rtw_image image;
+    shared_ptr<cached_image> image;
+    
+    static color bilinear(const rtw_image& image, double u, double v) {
+      auto x = u * image.width() - 0.5;
+      auto y = v * image.height() - 0.5;
+      auto x0 = std::floor(x), y0 = std::floor(y);
+      auto fx = x - x0, fy = y - y0;
+      auto i = static_cast<int>(x0), j = static_cast<int>(y0);
+      
+      auto p00 = image.pixel_data(i, j), p10 = image.pixel_data(i + 1, j);
+      auto p01 = image.pixel_data(i, j + 1), p11 = image.pixel_data(i + 1, j + 1);
+      
+      auto color_scale = 1.0 / 255.0;
+      color c;
+      for (int k = 0; k < 3; k++) {
+        auto top = (1 - fx) * p00[k] + fx * p10[k];
+        auto bottom = (1 - fx) * p01[k] + fx * p11[k];
+        c[k] = color_scale * ((1 - fy) * top + fy * bottom);
+      }
+      return c;
+    }
 };
 
 #endif
@@ -0,0 +1,281 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "rtweekend.h"
+#include "rtw_stb_image.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <map>
+
+// Process-wide cache of texture mip levels. Images are opened with only their header read;
+// a mip level is decoded (or downsampled from a finer resident level) the first time a lookup
+// needs it. When the resident levels exceed the memory budget, the least recently used levels
+// are evicted and decoded again if they are needed later.
+//
+// Lookups never lock: they read the level pointer inside a texture_cache::read_guard. Evicted
+// levels are only freed once every thread that might still be reading them has left its guard
+// (epoch based reclamation).
+//
+// Every file is opened once per process, whichever model or material asks for it: images are
+// shared by canonical path. Nothing is decoded at load time. The first lookup of an image decodes
+// it on the render thread that needs it, while other threads wanting the same image wait on its
+// load mutex, so each file is decoded once and different images decode in parallel.
+
+class texture_cache;
+
+class cached_image {
+public:
+  std::string path;   // Resolved file path
+  int width = 0;      // Size of level 0
+  int height = 0;
+  int level_count = 0;
+
+  cached_image(const cached_image&) = delete;
+  cached_image& operator=(const cached_image&) = delete;
+  ~cached_image();
+
+  bool valid() const { return level_count > 0; }
+
+  // Returns mip level `l`, loading it if needed. Only valid inside a read_guard.
+  const rtw_image& level(int l);
+
+private:
+  friend class texture_cache;
+
+  struct level_slot {
+    std::atomic<const rtw_image*> image{nullptr};
+    std::atomic<uint64_t> last_use{0};
+  };
+
+  cached_image(texture_cache& _cache, const char* filename);
+
+  texture_cache& cache;
+  std::unique_ptr<level_slot[]> levels;
+  std::mutex load_mutex;
+};
+
+class texture_cache {
+public:
+  static texture_cache& global() {
+    static texture_cache cache;
+    return cache;
+  }
+
+  class read_guard {
+    // Announces that the calling thread may read cached levels until the guard is destroyed.
+  public:
+    read_guard() : slot{thread_slot()}, previous{slot.load(std::memory_order_relaxed)} {
+      if (previous == 0) slot.store(global().epoch.load());
+    }
+    ~read_guard() {
+      if (previous == 0) slot.store(0, std::memory_order_release);
+    }
+  private:
+    std::atomic<uint64_t>& slot;
+    uint64_t previous;
+  };
+
+  shared_ptr<cached_image> open(const char* filename) {
+    // Opens an image without decoding it, or returns the already open image of the same file.
+    // Levels are loaded on first access.
+    std::string key = filename;
+    std::string path;
+    int width, height;
+    if (rtw_image::info(filename, path, width, height)) {
+      std::error_code error;
+      auto canonical = std::filesystem::weakly_canonical(path, error);
+      key = error ? path : canonical.string();
+    }
+    
+    std::lock_guard<std::mutex> lock(images_mutex);
+    if (auto image = opened[key].lock())
+      return image;
+    auto image = shared_ptr<cached_image>(new cached_image(*this, filename));
+    images.push_back(image.get());
+    opened[key] = image;
+    return image;
+  }
+
+  void set_budget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(evict_mutex);
+    budget = bytes;
+    evict();
+  }
+
+  size_t budget_bytes() const { return budget; }
+  size_t resident_bytes() const { return resident; }
+
+private:
+  friend class cached_image;
+
+  std::atomic<uint64_t> epoch{1};   // 0 marks a thread outside of any read_guard
+  std::atomic<uint64_t> clock{1};   // Advances on every miss, orders level use for LRU eviction
+  std::atomic<size_t> resident{0};
+  size_t budget;
+
+  std::mutex images_mutex;
+  std::vector<cached_image*> images;
+  std::map<std::string, std::weak_ptr<cached_image>> opened; // by canonical path
+
+  std::mutex evict_mutex;
+  std::vector<std::pair<uint64_t, const rtw_image*>> retired; // (epoch, level) awaiting free
+
+  std::mutex threads_mutex;
+  std::vector<std::atomic<uint64_t>*> thread_slots;
+
+  texture_cache() {
+    // Budget in MB from RTW_TEXTURE_CACHE_MB, 4 GB if not set.
+    auto env = getenv("RTW_TEXTURE_CACHE_MB");
+    budget = size_t(env ? atoll(env) : 4096) << 20;
+  }
+
+  ~texture_cache() {
+    for (auto& r : retired) delete r.second;
+  }
+
+  struct thread_registration {
+    std::atomic<uint64_t> slot{0};
+    thread_registration() {
+      auto& cache = global();
+      std::lock_guard<std::mutex> lock(cache.threads_mutex);
+      cache.thread_slots.push_back(&slot);
+    }
+    ~thread_registration() {
+      auto& cache = global();
+      std::lock_guard<std::mutex> lock(cache.threads_mutex);
+      auto& slots = cache.thread_slots;
+      slots.erase(std::find(slots.begin(), slots.end(), &slot));
+    }
+  };
+
+  static std::atomic<uint64_t>& thread_slot() {
+    static thread_local thread_registration registration;
+    return registration.slot;
+  }
+
+  const rtw_image* insert(cached_image::level_slot& slot, rtw_image&& level, uint64_t last_use) {
+    auto resident_level = new rtw_image(std::move(level));
+    resident += resident_level->size_in_bytes();
+    slot.last_use.store(last_use, std::memory_order_relaxed);
+    slot.image.store(resident_level);
+    return resident_level;
+  }
+
+  void evict() {
+    // Drops least recently used levels until the resident size fits the budget. Expects
+    // evict_mutex to be held.
+    while (resident > budget) {
+      cached_image::level_slot* victim = nullptr;
+      uint64_t oldest = UINT64_MAX;
+      {
+        std::lock_guard<std::mutex> lock(images_mutex);
+        for (auto image : images) {
+          for (int l = 0; l < image->level_count; l++) {
+            auto& slot = image->levels[l];
+            auto last_use = slot.last_use.load(std::memory_order_relaxed);
+            if (slot.image.load() != nullptr && last_use < oldest)
+              oldest = last_use, victim = &slot;
+          }
+        }
+      }
+      if (victim == nullptr) break;
+      auto level = victim->image.exchange(nullptr);
+      if (level == nullptr) continue;
+      resident -= level->size_in_bytes();
+      // Readers that announced an epoch up to this one may still hold the level.
+      retired.emplace_back(epoch.fetch_add(1), level);
+    }
+    reclaim();
+  }
+
+  void reclaim() {
+    // Frees retired levels no reader can still see. Expects evict_mutex to be held.
+    uint64_t oldest_reader = UINT64_MAX;
+    {
+      std::lock_guard<std::mutex> lock(threads_mutex);
+      for (auto slot : thread_slots) {
+        auto e = slot->load();
+        if (e != 0) oldest_reader = std::min(oldest_reader, e);
+      }
+    }
+    auto freeable = [&](const std::pair<uint64_t, const rtw_image*>& r) {
+      if (r.first >= oldest_reader) return false;
+      delete r.second;
+      return true;
+    };
+    retired.erase(std::remove_if(retired.begin(), retired.end(), freeable), retired.end());
+  }
+
+  const rtw_image* load(cached_image& image, int l) {
+    // Miss path: makes level `l` resident, starting from the closest finer level that still is,
+    // or from the file. The returned level stays valid while the caller's read_guard lives, even
+    // if it gets evicted right away.
+    uint64_t now = clock.fetch_add(1) + 1;
+    const rtw_image* level = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(image.load_mutex);
+      int source = l;
+      for (; source >= 0; source--)
+        if ((level = image.levels[source].image.load()) != nullptr) break;
+
+      if (level == nullptr) {
+        level = insert(image.levels[0], rtw_image(image.path.c_str()), l == 0 ? now : 0);
+        source = 0;
+      }
+      // Intermediate levels go in as least recently used, first in line for eviction.
+      for (int k = source + 1; k <= l; k++)
+        level = insert(image.levels[k], level->downsample(), k == l ? now : 0);
+      image.levels[l].last_use.store(now, std::memory_order_relaxed);
+    }
+    {
+      std::lock_guard<std::mutex> lock(evict_mutex);
+      evict();
+    }
+    return level;
+  }
+};
+
+inline cached_image::cached_image(texture_cache& _cache, const char* filename) : cache{_cache} {
+  if (!rtw_image::info(filename, path, width, height)) {
+    std::cerr << "ERROR: Could not load image file '" << filename << "'.\n";
+    return;
+  }
+  level_count = 1;
+  for (int w = width, h = height; w > 1 || h > 1; w = std::max(1, w / 2), h = std::max(1, h / 2))
+    level_count++;
+  levels = std::make_unique<level_slot[]>(level_count);
+}
+
+inline cached_image::~cached_image() {
+  std::lock_guard<std::mutex> evict_lock(cache.evict_mutex);
+  {
+    std::lock_guard<std::mutex> lock(cache.images_mutex);
+    auto& images = cache.images;
+    images.erase(std::find(images.begin(), images.end(), this));
+  }
+  for (int l = 0; l < level_count; l++) {
+    if (auto level = levels[l].image.exchange(nullptr)) {
+      cache.resident -= level->size_in_bytes();
+      delete level;
+    }
+  }
+}
+
+inline const rtw_image& cached_image::level(int l) {
+  auto& slot = levels[l];
+  auto image = slot.image.load();
+  if (image == nullptr)
+    image = cache.load(*this, l);
+  // Only write the timestamp when it changes, so hot levels stay read-only between threads.
+  auto now = cache.clock.load(std::memory_order_relaxed);
+  if (slot.last_use.load(std::memory_order_relaxed) != now)
+    slot.last_use.store(now, std::memory_order_relaxed);
+  return *image;
+}
+
+#endif
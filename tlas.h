@@ -1,8 +1,15 @@
+#ifndef TLAS_H
+#define TLAS_H
+
 #include "hittable.h"
 
 #include "bvh.h"
+#include "arena.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <cstdlib>
+#include <vector>
 
 struct tlas_node // TLAS - Top-level Acceleration Structure
 {
@@ -16,48 +23,28 @@ template<typename T>
 class tlas : public hittable {
 public:
   tlas() = default;
-  tlas(bvh_instance<T>* bvh_list, int N) {
+  tlas(bvh_instance<T>* bvh_list, int N, arena* mem = nullptr) {
     // copy a pointer to the array of bottom level accstructs instances
     blas = bvh_list;
     blas_count = N;
-    // allocate TLAS nodes
-#if _MSC_VER >= 1900
-    tlas_nodes = (tlas_node*)_aligned_malloc(sizeof(tlas_node) * 2 * N, 64);
-#else
-    tlas_nodes = (tlas_node*)std::aligned_alloc(64, sizeof(tlas_node) * N * 2);
-#endif
+    // allocate TLAS nodes, from `mem` or from an arena of the TLAS's own
+    if (mem == nullptr) {
+      own_memory = std::make_unique<arena>(sizeof(tlas_node) * N * 2);
+      mem = own_memory.get();
+    }
+    tlas_nodes = mem->allocate_array<tlas_node>(N * 2);
     nodes_used = 2;
   }
 
-  ~tlas() {
-      if (tlas_nodes) {
-        free(tlas_nodes);
-        tlas_nodes = nullptr;
-      }
-  }
-  
-  tlas(tlas&& a)
-  : bounds{a.bounds},
-    center{a.center},
-    tlas_nodes{a.tlas_nodes},
-    blas{a.blas},
-    nodes_used{a.nodes_used}, blas_count{a.primitives_count} {
-      tlas_nodes = nullptr;
-      blas = nullptr;
-
-      nodes_used = 0;
-      blas_count = 0;
-  }
-  
-  tlas<T>& operator=(tlas&& a) {
-    std::swap(tlas_nodes, a.tlas_nodes);
-    std::swap(blas, a.blas);
-    return *this;
-  }
+  tlas(tlas&&) = default;
+  tlas<T>& operator=(tlas&&) = default;
  
   void build() {
+    RTW_SPAN("tlas build", blas_count);
+    RTW_STAT(auto t1 = std::chrono::high_resolution_clock::now());
     // assign a TLASleaf node to each BLAS
-    int node_idx[1024], node_indices = blas_count;
+    std::vector<int> node_idx(blas_count);
+    int node_indices = blas_count;
     nodes_used = 1;
     for (int i = 0; i < blas_count; i++) {
       node_idx[i] = nodes_used;
@@ -67,9 +54,9 @@ public:
       tlas_nodes[nodes_used++].left_right = 0; // make it a leaft
     }
     // use agglomerative clustering to build the TLAS
-    int A = 0, B = find_best_match(node_idx, node_indices, A);
+    int A = 0, B = find_best_match(node_idx.data(), node_indices, A);
     while (node_indices > 1) {
-      int C = find_best_match(node_idx, node_indices, B);
+      int C = find_best_match(node_idx.data(), node_indices, B);
       if (A == C) {
         int node_idx_A = node_idx[A], node_idx_B = node_idx[B];
         tlas_node& node_A = tlas_nodes[node_idx_A];
@@ -80,11 +67,13 @@ public:
         new_node.bbox.bmax = fmaxf(node_A.bbox.bmax, node_B.bbox.bmax);
         node_idx[A] = nodes_used++;
         node_idx[B] = node_idx[node_indices - 1];
-        B = find_best_match(node_idx, --node_indices, A);
+        B = find_best_match(node_idx.data(), --node_indices, A);
       }
       else A = B, B = C;
     }
     tlas_nodes[0] = tlas_nodes[node_idx[A]];
+    RTW_STAT(stats::local().bvh_build_ms += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t1).count());
+    RTW_STAT(quality().print(std::clog, "TLAS"));
     
     bounds = aabb(tlas_nodes[0].bbox.bmin, tlas_nodes[0].bbox.bmax);
     center = (bounds.bmax + bounds.bmin) / 2.0f;
@@ -95,11 +84,14 @@ public:
     int stack_ptr = 0;
     auto closest_so_far = ray_t.max;
     bool hit_anything = false;
+    RTW_STAT(auto& counters = stats::local());
     
     while (true)
     {
+      RTW_STAT(counters.tlas_nodes_visited++);
       if(node->is_leaf()) {
         hit_record temp_rec;
+        RTW_STAT(counters.tlas_leaf_visits++);
         
         if (blas[node->blas].hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
           hit_anything = true;
@@ -118,6 +110,7 @@ public:
         tlas_node* child2 = &tlas_nodes[node->left_right >> 16];
         interval i_b = interval(ray_t.min, closest_so_far);
         float dist2 = child2->bbox.hit(r, i_b);
+        RTW_STAT(counters.box_tests += 2);
  
         if (dist1 > dist2) { std::swap( dist1, dist2 ); std::swap( child1, child2 ); }
         if (dist1 == infinity)
@@ -142,6 +135,29 @@ public:
   aabb bounding_box() const override {
     return bounds;
   }
+
+  bvh_quality quality() const {
+    // Leaves hold one instance each; their cost counts an instance as one primitive test.
+    bvh_quality q;
+    if (blas_count == 0) return q;
+    std::vector<std::pair<int, int>> stack{{0, 0}};  // node, depth
+    while (!stack.empty()) {
+      auto [index, depth] = stack.back();
+      stack.pop_back();
+      const tlas_node& node = tlas_nodes[index];
+      if (node.is_leaf()) {
+        q.add_leaf(node.bbox, depth, 1);
+        continue;
+      }
+      int left = node.left_right & 0xffff, right = node.left_right >> 16;
+      q.add_interior(node.bbox, depth, tlas_nodes[left].bbox, tlas_nodes[right].bbox);
+      stack.push_back({left, depth + 1});
+      stack.push_back({right, depth + 1});
+    }
+    q.memory = sizeof(tlas_node) * nodes_used;
+    q.finish(tlas_nodes[0].bbox);
+    return q;
+  }
     
   point3f centroid() const override { return center; }
 private:
@@ -159,11 +175,14 @@ private:
     return best_b;
   }
   
+  std::unique_ptr<arena> own_memory; // when not given an arena
   aabb bounds;
   point3f center; 
   
   tlas_node* tlas_nodes = nullptr;
   bvh_instance<T>* blas = nullptr; // array of BLASs
-  int nodes_used;
-  int blas_count;
+  int nodes_used = 0;
+  int blas_count = 0;
 };
+
+#endif
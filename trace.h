@@ -0,0 +1,182 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Timeline of what every thread was doing, compiled in when RTW_TRACE is defined and free
+// otherwise. A span times the rest of its scope; every thread records its spans into a ring
+// buffer of its own, keeping the last events_per_lane of them. At exit the timeline is written
+// as Chrome trace_event JSON to the file named by the RTW_TRACE_JSON environment variable
+// (trace.json by default), to be opened in chrome://tracing or ui.perfetto.dev.
+//
+//   RTW_SPAN("bvh build", N);  // name (a string literal) and an optional count shown with it
+//
+// Threads that exit hand their buffer back for the next thread to continue, so a lane in the
+// timeline is a sequence of threads that never ran at the same time, not a single thread.
+
+#ifdef RTW_TRACE
+#define RTW_TRACE_ONLY(...) __VA_ARGS__
+#define RTW_SPAN_NAME2(line) rtw_span_##line
+#define RTW_SPAN_NAME(line) RTW_SPAN_NAME2(line)
+#define RTW_SPAN(...) trace::span RTW_SPAN_NAME(__LINE__){__VA_ARGS__}
+#else
+#define RTW_TRACE_ONLY(...)
+#define RTW_SPAN(...)
+#endif
+
+class trace {
+public:
+  static constexpr size_t events_per_lane = 1 << 16;
+
+  struct event {
+    const char* name;
+    int64_t begin;  // nanoseconds since the first span
+    int64_t end;
+    int64_t value;  // shown with the span unless negative
+    int lane;       // lane of the timeline the span goes to
+  };
+
+  class span {
+  public:
+    explicit span(const char* _name, int64_t _value = -1) : name{_name}, value{_value}, begin{now()} {}
+    span(const span&) = delete;
+    span& operator=(const span&) = delete;
+    ~span() { record(name, begin, now(), value); }
+
+  private:
+    const char* name;
+    int64_t value;
+    int64_t begin;
+  };
+
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - registry().epoch).count();
+  }
+
+  struct mark {
+    int lane;
+    uint64_t owner;  // which of the threads that had the lane
+    int64_t time;
+  };
+
+  static mark here() {
+    // The calling thread's place in the timeline, now.
+    auto& b = local();
+    return {b.lane, b.owners, now()};
+  }
+
+  static void record_idle(const mark& from, int64_t until) {
+    // Records the lane of `from` as idle from then until `until`, or until another thread took
+    // the lane over, if one did in between.
+    int64_t end = until;
+    {
+      std::lock_guard<std::mutex> lock(registry().mutex);
+      auto& b = *registry().buffers[from.lane - 1];
+      if (b.owners != from.owner) end = std::min(end, b.taken);
+    }
+    if (end > from.time) record("idle", from.time, end, -1, from.lane);
+  }
+
+  static void record(const char* name, int64_t begin, int64_t end, int64_t value = -1, int lane = -1) {
+    // Adds a span that ended, to the lane of the calling thread unless another one is given
+    // (e.g. for the time a worker spent waiting, recorded by the thread that knows it).
+    auto& b = local();
+    b.events[b.count++ % events_per_lane] = {name, begin, end, value, lane < 0 ? b.lane : lane};
+  }
+
+  static bool write(const char* path) {
+    // Writes the events still in the buffers, oldest first within every lane. Call once the
+    // threads that recorded them are done (at exit it is done automatically).
+    return write(registry(), path);
+  }
+
+private:
+  struct buffer {
+    int lane;
+    uint64_t count = 0;  // events recorded, the buffer holds the last events_per_lane
+    uint64_t owners = 0; // threads that took the buffer so far
+    int64_t taken = 0;   // when the last one did
+    std::unique_ptr<event[]> events{new event[events_per_lane]};
+  };
+
+  struct lanes {
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    std::mutex mutex;
+    std::vector<std::unique_ptr<buffer>> buffers;  // all buffers, in use or free
+    std::vector<buffer*> free;
+
+    ~lanes() {
+      // Every thread has exited by now, the main thread's slot included.
+      auto path = getenv("RTW_TRACE_JSON");
+      if (path == nullptr) path = const_cast<char*>("trace.json");
+      if (!buffers.empty() && !write(*this, path)) fprintf(stderr, "ERROR: Could not write trace to %s\n", path);
+    }
+  };
+
+  static bool write(lanes& r, const char* path) {
+    std::lock_guard<std::mutex> lock(r.mutex);
+    FILE* out = fopen(path, "w");
+    if (out == nullptr) return false;
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    bool first = true;
+    for (auto& b : r.buffers) {
+      fprintf(out, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"lane %d\"}}",
+              first ? "" : ",", b->lane, b->lane);
+      first = false;
+      auto kept = std::min<uint64_t>(b->count, events_per_lane);
+      for (uint64_t i = b->count - kept; i < b->count; i++) {
+        auto& e = b->events[i % events_per_lane];
+        fprintf(out, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+                e.name, e.lane, e.begin / 1e3, (e.end - e.begin) / 1e3);
+        if (e.value >= 0) fprintf(out, ", \"args\": {\"n\": %lld}", (long long)e.value);
+        fprintf(out, "}");
+      }
+    }
+    fprintf(out, "\n]}\n");
+    return fclose(out) == 0;
+  }
+
+  static lanes& registry() {
+    static lanes r;
+    return r;
+  }
+
+  struct slot {
+    // Takes a buffer when the thread first records, hands it back when the thread exits, like
+    // the blocks of stats.h.
+    buffer* b;
+
+    slot() {
+      auto& r = registry();
+      std::lock_guard<std::mutex> lock(r.mutex);
+      if (r.free.empty()) {
+        r.buffers.push_back(std::make_unique<buffer>());
+        r.buffers.back()->lane = int(r.buffers.size());
+        r.free.push_back(r.buffers.back().get());
+      }
+      b = r.free.back();
+      r.free.pop_back();
+      b->owners++;
+      b->taken = now();
+    }
+
+    ~slot() {
+      std::lock_guard<std::mutex> lock(registry().mutex);
+      registry().free.push_back(b);
+    }
+  };
+
+  static buffer& local() {
+    thread_local slot s;
+    return *s.b;
+  }
+};
+
+#endif
@@ -59,7 +59,7 @@ public:
        return false;
     }
 
-    auto normal = (1 - u - v) * n1 + u * n2 + v * n3;
+    auto normal = unit_vector((1 - u - v) * n1 + u * n2 + v * n3);
     auto tex_u = uv1.x() * (1 - u - v)
       + uv2.x() * u
       + uv3.x() * v;
@@ -73,15 +73,19 @@ public:
     rec.u = tex_u;
     rec.v = tex_v;
     rec.mat = mat;
+    
+    // texture space area over world space area gives the texel density for mip selection
+    auto world_area = cross(v2 - v1, v3 - v1).length();
+    auto duv1 = uv2 - uv1, duv2 = uv3 - uv1;
+    auto uv_area = fabs(duv1.x() * duv2.y() - duv2.x() * duv1.y());
+    rec.set_uv_footprint(r, world_area > 0 ? sqrt(uv_area / world_area) : 0);
     return true;
     return false;
   }
  
     friend std::ostream& operator<<(std::ostream & out, const triangle & t);
-private:
-  point3 center;
-  aabb bbox;
   
+  // Moller-Trumbore ray/triangle test, shared with mesh_triangle.
   static bool intersect_triangle(
     const ray& r,
     const point3 v0, const point3 v1, const point3 v2,
@@ -150,6 +154,10 @@ private:
 #endif
     return true;
   }
+
+private:
+  point3 center;
+  aabb bbox;
 };
 
 inline std::ostream& operator<<(std::ostream & out, const triangle & t) {
@@ -2,6 +2,7 @@
 #define VEC3_h
 
 #include "vec4.h"
+#include "vec2.h"
 
 #include <cmath>
 #include <iostream>
@@ -113,32 +114,46 @@ inline vec3 unit_vector(vec3 v) {
 	return v / v.length();
 }
 
-inline vec3 random_in_unit_disk() {
-  while(true) {
-    auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-    if (p.length_squared() < 1)
-      return p;
-  }
+// Sample warps. Each maps a fixed number of uniform [0,1) sample dimensions in closed form, so they
+// work with stratified and low-discrepancy samplers and have no data-dependent loops.
+
+inline vec3 random_in_unit_disk(const vec2& u) {
+  // Shirley-Chiu concentric mapping of the unit square onto the unit disk (z = 0).
+  auto a = 2 * u.x() - 1;
+  auto b = 2 * u.y() - 1;
+  bool x_major = a * a > b * b;
+  auto r = x_major ? a : b;
+  auto d = (r != 0) ? r : 1.0;
+  auto phi = x_major ? (pi / 4) * (b / d) : (pi / 2) - (pi / 4) * (a / d);
+  return vec3(r * cos(phi), r * sin(phi), 0);
 }
 
-inline vec3 random_in_unit_sphere() {
-  while(true) {
-    auto p = vec3::random(-1, 1);
-    if (p.length_squared() < 1)
-      return p;
-  }
+inline vec3 random_unit_vector(const vec2& u) {
+  // Uniformly distributed direction on the unit sphere.
+  auto z = 1 - 2 * u.x();
+  auto r = sqrt(fmax(0.0, 1 - z * z));
+  auto phi = 2 * pi * u.y();
+  return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+inline vec3 random_in_unit_sphere(const vec2& u, double u_radius) {
+  // Uniformly distributed point inside the unit sphere.
+  return std::cbrt(u_radius) * random_unit_vector(u);
 }
 
-inline vec3 random_unit_vector() {
-  return unit_vector(random_in_unit_sphere());
+inline vec3 random_cosine_direction(const vec2& u) {
+  // Cosine-weighted direction on the hemisphere around +z (Malley's method).
+  auto d = random_in_unit_disk(u);
+  auto z = sqrt(fmax(0.0, 1 - d.x() * d.x() - d.y() * d.y()));
+  return vec3(d.x(), d.y(), z);
 }
 
-inline vec3 random_on_hemisphere(const vec3& normal) {
-  vec3 on_unit_sphere = random_unit_vector();
-  if (dot(on_unit_sphere, normal) > 0.0) // In the name hemisphere as the normal
-    return on_unit_sphere;
-  else
-    return -on_unit_sphere;
+inline vec3 random_on_hemisphere(const vec2& u) {
+  // Uniformly distributed direction on the hemisphere around +z.
+  auto z = u.x();
+  auto r = sqrt(fmax(0.0, 1 - z * z));
+  auto phi = 2 * pi * u.y();
+  return vec3(r * cos(phi), r * sin(phi), z);
 }
 
 inline vec3 reflect(const vec3& v, const vec3& n) {